@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2013 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <time.h>
+#include <unistd.h>
+
+#include "taskqueue.h"
+
+/* Submit jobs of a single class limited by an admission policy, and check
+ * the limits from the jobs themselves: with an in-flight cap, no more jobs
+ * than the cap may run at the same time; with a rate limit, jobs are
+ * admitted no faster than the rate, after an initial burst. */
+
+struct result {
+    unsigned long nb_results[4]; /* indexed by enum tq_admission_result */
+    double duration; /* seconds */
+};
+
+static void die(const char *, ...)
+    __attribute__((format(printf, 1, 2)));
+static void usage(const char *, int);
+static unsigned long parse_ulong(const char *, const char *);
+
+static void run(const struct tq_admission_policy *, unsigned long, double,
+                struct result *);
+static int job_func(void *);
+static void shed_func(void *);
+
+static uint64_t now_ns(void);
+
+static enum tq_queue_mode mode = TQ_QUEUE_FIFO;
+static int nb_threads = 8;
+static unsigned long job_delay = 1000; /* microseconds */
+
+static unsigned long nb_running;
+static unsigned long max_running;
+static unsigned long nb_runs;
+static unsigned long nb_shed;
+
+int
+main(int argc, char **argv) {
+    struct tq_admission_policy policy;
+    struct result result;
+    unsigned long nb_jobs, cap, burst, rate;
+    double expected;
+    bool failed;
+    int opt;
+
+    nb_jobs = 1000;
+    cap = 4;
+    rate = 1000;
+    burst = 10;
+
+    opterr = 0;
+    while ((opt = getopt(argc, argv, "b:c:d:hmn:r:t:")) != -1) {
+        switch (opt) {
+            case 'b':
+                burst = parse_ulong(optarg, "burst");
+                break;
+
+            case 'c':
+                cap = parse_ulong(optarg, "cap");
+                break;
+
+            case 'd':
+                job_delay = parse_ulong(optarg, "job delay");
+                break;
+
+            case 'h':
+                usage(argv[0], 0);
+                break;
+
+            case 'm':
+                mode = TQ_QUEUE_MULTIQUEUE;
+                break;
+
+            case 'n':
+                nb_jobs = parse_ulong(optarg, "number of jobs");
+                break;
+
+            case 'r':
+                rate = parse_ulong(optarg, "rate");
+                break;
+
+            case 't':
+                nb_threads = (int)parse_ulong(optarg, "number of threads");
+                break;
+
+            case '?':
+                usage(argv[0], 1);
+        }
+    }
+
+    if (nb_jobs == 0 || cap == 0 || rate == 0 || burst == 0)
+        usage(argv[0], 1);
+
+    failed = false;
+
+    printf("%-12s %8s %8s %8s %8s %8s %10s\n", "policy",
+           "queued", "parked", "rejected", "shed", "run", "result");
+
+    /* In-flight cap, excess jobs parked: all jobs run, never more than cap
+     * at the same time */
+    memset(&policy, 0, sizeof(struct tq_admission_policy));
+    policy.max_in_flight = (uint32_t)cap;
+    policy.action = TQ_OVERLOAD_PARK;
+
+    run(&policy, nb_jobs, 0.0, &result);
+
+    printf("%-12s %8lu %8lu %8lu %8lu %8lu %5lu <= %lu\n", "cap/park",
+           result.nb_results[TQ_JOB_QUEUED],
+           result.nb_results[TQ_JOB_PARKED],
+           result.nb_results[TQ_JOB_REJECTED],
+           result.nb_results[TQ_JOB_SHED], nb_runs, max_running, cap);
+    if (max_running > cap || nb_runs != nb_jobs)
+        failed = true;
+
+    /* In-flight cap, excess jobs rejected: only queued jobs run */
+    policy.action = TQ_OVERLOAD_REJECT;
+
+    run(&policy, nb_jobs, 0.0, &result);
+
+    printf("%-12s %8lu %8lu %8lu %8lu %8lu %5lu <= %lu\n", "cap/reject",
+           result.nb_results[TQ_JOB_QUEUED],
+           result.nb_results[TQ_JOB_PARKED],
+           result.nb_results[TQ_JOB_REJECTED],
+           result.nb_results[TQ_JOB_SHED], nb_runs, max_running, cap);
+    if (max_running > cap || nb_runs != result.nb_results[TQ_JOB_QUEUED])
+        failed = true;
+
+    /* Rate limit, excess jobs parked: the last jobs are admitted once
+     * (nb_jobs - burst) / rate seconds have elapsed */
+    memset(&policy, 0, sizeof(struct tq_admission_policy));
+    policy.rate = (double)rate;
+    policy.burst = (uint32_t)burst;
+    policy.action = TQ_OVERLOAD_PARK;
+
+    run(&policy, nb_jobs, 0.0, &result);
+
+    expected = (double)(nb_jobs > burst ? nb_jobs - burst : 0) / (double)rate;
+
+    printf("%-12s %8lu %8lu %8lu %8lu %8lu %5.2fs ~ %.2fs\n", "rate/park",
+           result.nb_results[TQ_JOB_QUEUED],
+           result.nb_results[TQ_JOB_PARKED],
+           result.nb_results[TQ_JOB_REJECTED],
+           result.nb_results[TQ_JOB_SHED], nb_runs,
+           result.duration, expected);
+    if (nb_runs != nb_jobs || result.duration < expected * 0.9)
+        failed = true;
+
+    /* Rate limit, excess jobs shed: jobs are submitted for nb_jobs / rate
+     * seconds, and about burst + nb_jobs are admitted */
+    policy.action = TQ_OVERLOAD_SHED;
+    policy.shed = shed_func;
+
+    run(&policy, 0, (double)nb_jobs / (double)rate, &result);
+
+    printf("%-12s %8lu %8lu %8lu %8lu %8lu %5lu ~ %lu\n", "rate/shed",
+           result.nb_results[TQ_JOB_QUEUED],
+           result.nb_results[TQ_JOB_PARKED],
+           result.nb_results[TQ_JOB_REJECTED],
+           result.nb_results[TQ_JOB_SHED], nb_runs,
+           result.nb_results[TQ_JOB_QUEUED], burst + nb_jobs);
+    if (nb_shed != result.nb_results[TQ_JOB_SHED]
+     || result.nb_results[TQ_JOB_QUEUED] > burst + nb_jobs + 1) {
+        failed = true;
+    }
+
+    return failed ? 1 : 0;
+}
+
+static void
+usage(const char *argv0, int exit_code) {
+    printf("Usage: %s [-bcdhmnrt]\n"
+            "\n"
+            "Options:\n"
+            "  -b <nb>    burst of the rate limit\n"
+            "  -c <nb>    in-flight cap\n"
+            "  -d <us>    time spent in each job in microseconds\n"
+            "  -h         display help\n"
+            "  -m         use the multiqueue mode\n"
+            "  -n <nb>    number of jobs\n"
+            "  -r <nb>    rate limit in jobs per second\n"
+            "  -t <nb>    number of threads used\n",
+            argv0);
+    exit(exit_code);
+}
+
+static void
+die(const char *fmt, ...) {
+    va_list ap;
+
+    fprintf(stderr, "fatal error: ");
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+    putc('\n', stderr);
+    exit(1);
+}
+
+static unsigned long
+parse_ulong(const char *str, const char *name) {
+    unsigned long lval;
+
+    errno = 0;
+    lval = strtoul(str, NULL, 10);
+    if (errno)
+        die("invalid %s: %m", name);
+    if (lval > INT_MAX)
+        die("invalid %s", name);
+
+    return lval;
+}
+
+/* Submit nb_jobs jobs, or as many jobs as possible for duration seconds if
+ * nb_jobs is 0, and wait for admitted jobs to run */
+static void
+run(const struct tq_admission_policy *policy, unsigned long nb_jobs,
+    double duration, struct result *result) {
+    struct tq_queue *taskqueue;
+    uint64_t start, end;
+
+    memset(result, 0, sizeof(struct result));
+
+    nb_running = 0;
+    max_running = 0;
+    nb_runs = 0;
+    nb_shed = 0;
+
+    taskqueue = tq_queue_new(nb_threads);
+    if (!taskqueue)
+        die("cannot create task queue: %s", tq_get_error());
+
+    if (tq_queue_set_mode(taskqueue, mode) == -1)
+        die("cannot set queue mode: %s", tq_get_error());
+
+    if (tq_queue_set_class_policy(taskqueue, 0, policy) == -1)
+        die("cannot set class policy: %s", tq_get_error());
+
+    if (tq_queue_start(taskqueue) == -1)
+        die("cannot start task queue: %s", tq_get_error());
+
+    start = now_ns();
+    end = start + (uint64_t)(duration * 1e9);
+
+    for (unsigned long i = 0; nb_jobs > 0 ? i < nb_jobs : now_ns() < end;
+         i++) {
+        int ret;
+
+        ret = tq_queue_admit_job(taskqueue, 0, job_func, NULL);
+        if (ret == -1)
+            die("cannot admit job: %s", tq_get_error());
+
+        result->nb_results[ret]++;
+    }
+
+    if (tq_queue_drain(taskqueue) == -1)
+        die("cannot drain task queue: %s", tq_get_error());
+    if (tq_queue_stop(taskqueue) == -1)
+        die("cannot stop task queue: %s", tq_get_error());
+
+    result->duration = (double)(now_ns() - start) / 1e9;
+
+    tq_queue_delete(taskqueue);
+}
+
+static int
+job_func(void *arg) {
+    unsigned long running, max;
+
+    running = __atomic_add_fetch(&nb_running, 1, __ATOMIC_SEQ_CST);
+
+    max = __atomic_load_n(&max_running, __ATOMIC_RELAXED);
+    while (running > max) {
+        if (__atomic_compare_exchange_n(&max_running, &max, running, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (job_delay > 0) {
+        struct timespec ts;
+
+        ts.tv_sec = (time_t)(job_delay / 1000000);
+        ts.tv_nsec = (long)(job_delay % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+    }
+
+    __atomic_sub_fetch(&nb_running, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&nb_runs, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+static void
+shed_func(void *arg) {
+    __atomic_add_fetch(&nb_shed, 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t
+now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+}
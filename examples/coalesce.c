@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2013 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <time.h>
+#include <unistd.h>
+
+#include "taskqueue.h"
+
+/* Submit increments to a small set of counters as keyed jobs. Increments
+ * for a counter which already has a pending job are merged into it, so far
+ * fewer jobs run than are submitted, but every counter must end up with
+ * the sum of all its increments. */
+
+struct increment {
+    uint32_t counter;
+    uint64_t value;
+};
+
+static void die(const char *, ...)
+    __attribute__((format(printf, 1, 2)));
+static void usage(const char *, int);
+static unsigned long parse_ulong(const char *, const char *);
+
+static int job_func(void *);
+static void *combine_increments(void *, void *);
+
+static uint64_t *totals;
+static uint64_t nb_runs;
+static unsigned long job_delay; /* microseconds */
+
+int
+main(int argc, char **argv) {
+    struct tq_queue *taskqueue;
+    enum tq_queue_mode mode;
+    unsigned long nb_submissions, nb_queued, nb_coalesced, nb_errors;
+    uint64_t *expected;
+    uint32_t nb_counters;
+    int nb_threads;
+    int opt;
+
+    mode = TQ_QUEUE_FIFO;
+    nb_threads = 4;
+    nb_counters = 100;
+    nb_submissions = 1000000;
+    job_delay = 10;
+
+    opterr = 0;
+    while ((opt = getopt(argc, argv, "c:d:hmn:t:")) != -1) {
+        switch (opt) {
+            case 'c':
+                nb_counters = (uint32_t)parse_ulong(optarg,
+                                                    "number of counters");
+                break;
+
+            case 'd':
+                job_delay = parse_ulong(optarg, "job delay");
+                break;
+
+            case 'h':
+                usage(argv[0], 0);
+                break;
+
+            case 'm':
+                mode = TQ_QUEUE_MULTIQUEUE;
+                break;
+
+            case 'n':
+                nb_submissions = parse_ulong(optarg, "number of submissions");
+                break;
+
+            case 't':
+                nb_threads = (int)parse_ulong(optarg, "number of threads");
+                break;
+
+            case '?':
+                usage(argv[0], 1);
+        }
+    }
+
+    if (nb_counters == 0)
+        usage(argv[0], 1);
+
+    totals = calloc(nb_counters, sizeof(uint64_t));
+    expected = calloc(nb_counters, sizeof(uint64_t));
+    if (!totals || !expected)
+        die("cannot allocate counters: %m");
+
+    taskqueue = tq_queue_new(nb_threads);
+    if (!taskqueue)
+        die("cannot create task queue: %s", tq_get_error());
+
+    if (tq_queue_set_mode(taskqueue, mode) == -1)
+        die("cannot set queue mode: %s", tq_get_error());
+
+    if (tq_queue_start(taskqueue) == -1)
+        die("cannot start task queue: %s", tq_get_error());
+
+    nb_queued = 0;
+    nb_coalesced = 0;
+
+    for (unsigned long i = 0; i < nb_submissions; i++) {
+        struct increment *increment;
+        int ret;
+
+        increment = malloc(sizeof(struct increment));
+        if (!increment)
+            die("cannot allocate increment: %m");
+
+        increment->counter = (uint32_t)(i % nb_counters);
+        increment->value = i % 7 + 1;
+
+        expected[increment->counter] += increment->value;
+
+        ret = tq_queue_add_keyed_job(taskqueue, increment->counter,
+                                     job_func, increment,
+                                     combine_increments);
+        if (ret == -1)
+            die("cannot add keyed job: %s", tq_get_error());
+
+        if (ret == 0) {
+            nb_queued++;
+        } else {
+            nb_coalesced++;
+        }
+    }
+
+    if (tq_queue_drain(taskqueue) == -1)
+        die("cannot drain task queue: %s", tq_get_error());
+    if (tq_queue_stop(taskqueue) == -1)
+        die("cannot stop task queue: %s", tq_get_error());
+
+    tq_queue_delete(taskqueue);
+
+    nb_errors = 0;
+    for (uint32_t i = 0; i < nb_counters; i++) {
+        if (totals[i] != expected[i])
+            nb_errors++;
+    }
+
+    printf("submitted:      %lu\n", nb_submissions);
+    printf("queued:         %lu\n", nb_queued);
+    printf("coalesced:      %lu\n", nb_coalesced);
+    printf("run:            %llu\n", (unsigned long long)nb_runs);
+    printf("wrong totals:   %lu\n", nb_errors);
+
+    free(expected);
+    free(totals);
+
+    return nb_errors > 0 ? 1 : 0;
+}
+
+static void
+usage(const char *argv0, int exit_code) {
+    printf("Usage: %s [-cdhmnt]\n"
+            "\n"
+            "Options:\n"
+            "  -c <nb>    number of counters (keys)\n"
+            "  -d <us>    time spent in each job in microseconds\n"
+            "  -h         display help\n"
+            "  -m         use the multiqueue mode\n"
+            "  -n <nb>    number of submissions\n"
+            "  -t <nb>    number of threads used\n",
+            argv0);
+    exit(exit_code);
+}
+
+static void
+die(const char *fmt, ...) {
+    va_list ap;
+
+    fprintf(stderr, "fatal error: ");
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+    putc('\n', stderr);
+    exit(1);
+}
+
+static unsigned long
+parse_ulong(const char *str, const char *name) {
+    unsigned long lval;
+
+    errno = 0;
+    lval = strtoul(str, NULL, 10);
+    if (errno)
+        die("invalid %s: %m", name);
+    if (lval > INT_MAX)
+        die("invalid %s", name);
+
+    return lval;
+}
+
+static int
+job_func(void *arg) {
+    struct increment *increment;
+
+    increment = arg;
+
+    __atomic_add_fetch(&totals[increment->counter], increment->value,
+                       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&nb_runs, 1, __ATOMIC_RELAXED);
+
+    if (job_delay > 0) {
+        struct timespec ts;
+
+        ts.tv_sec = (time_t)(job_delay / 1000000);
+        ts.tv_nsec = (long)(job_delay % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+    }
+
+    free(increment);
+    return 0;
+}
+
+static void *
+combine_increments(void *pending_arg, void *arg) {
+    struct increment *pending, *increment;
+
+    pending = pending_arg;
+    increment = arg;
+
+    pending->value += increment->value;
+
+    /* The queue does not keep arg once it has been combined */
+    free(increment);
+    return pending;
+}
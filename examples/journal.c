@@ -0,0 +1,369 @@
+/*
+ * Copyright (c) 2013 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "taskqueue.h"
+
+/* Add durable jobs in a child process which crashes after having processed
+ * some of them, then restart the queue on the same journal in the parent
+ * and check that every job whose addition succeeded ran at least once.
+ * Jobs are added one at a time, or in batches synced at once. */
+
+#define HANDLER_ID 1
+
+/* Shared between the child and the parent */
+struct state {
+    uint32_t nb_processed;
+    uint32_t crash_after; /* 0 in the parent */
+    bool all_added;
+    uint64_t add_time; /* nanoseconds */
+
+    uint8_t *added;
+    uint32_t *nb_runs;
+};
+
+static void die(const char *, ...)
+    __attribute__((format(printf, 1, 2)));
+static void usage(const char *, int);
+static unsigned long parse_ulong(const char *, const char *);
+
+static struct tq_queue *open_queue(const char *, int);
+static void run_child(const char *, int, uint32_t, uint32_t);
+static int job_handler(const void *, size_t);
+static void remove_dir(const char *);
+
+static uint64_t now_ns(void);
+
+static struct state *state;
+
+int
+main(int argc, char **argv) {
+    char dir_template[] = "/tmp/tq-journal-XXXXXX";
+    struct tq_queue *taskqueue;
+    uint32_t nb_jobs, batch_size, nb_added, nb_done, nb_replayed, nb_dup,
+             nb_lost;
+    const char *dir;
+    bool tmp_dir;
+    size_t size;
+    uint8_t *mem;
+    int nb_threads, status;
+    pid_t pid;
+    int opt;
+
+    dir = NULL;
+    nb_threads = 4;
+    nb_jobs = 10000;
+    batch_size = 1;
+
+    opterr = 0;
+    while ((opt = getopt(argc, argv, "b:d:hn:t:")) != -1) {
+        switch (opt) {
+            case 'b':
+                batch_size = (uint32_t)parse_ulong(optarg, "batch size");
+                break;
+
+            case 'd':
+                dir = optarg;
+                break;
+
+            case 'h':
+                usage(argv[0], 0);
+                break;
+
+            case 'n':
+                nb_jobs = (uint32_t)parse_ulong(optarg, "number of jobs");
+                break;
+
+            case 't':
+                nb_threads = (int)parse_ulong(optarg, "number of threads");
+                break;
+
+            case '?':
+                usage(argv[0], 1);
+        }
+    }
+
+    if (nb_jobs == 0 || batch_size == 0)
+        usage(argv[0], 1);
+
+    tmp_dir = false;
+    if (!dir) {
+        dir = mkdtemp(dir_template);
+        if (!dir)
+            die("cannot create journal directory: %m");
+
+        tmp_dir = true;
+    }
+
+    size = sizeof(struct state) + nb_jobs * sizeof(uint32_t) + nb_jobs;
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        die("cannot map shared state: %m");
+
+    state = (struct state *)mem;
+    state->nb_runs = (uint32_t *)(mem + sizeof(struct state));
+    state->added = mem + sizeof(struct state) + nb_jobs * sizeof(uint32_t);
+
+    /* First run: the child crashes once half of the jobs were processed */
+    state->crash_after = nb_jobs / 2;
+
+    pid = fork();
+    if (pid == -1)
+        die("cannot fork: %m");
+    if (pid == 0)
+        run_child(dir, nb_threads, nb_jobs, batch_size);
+
+    if (waitpid(pid, &status, 0) == -1)
+        die("cannot wait for child: %m");
+
+    nb_added = 0;
+    nb_done = 0;
+    for (uint32_t i = 0; i < nb_jobs; i++) {
+        nb_added += state->added[i];
+        nb_done += (state->nb_runs[i] > 0);
+    }
+
+    printf("journal:     %s\n", dir);
+    printf("added:       %u (%.0f jobs/s)\n", nb_added,
+           (double)nb_added * 1e9 / (double)state->add_time);
+    printf("run before:  %u\n", nb_done);
+
+    /* Second run: pending jobs are replayed when the queue is started */
+    state->crash_after = 0;
+    state->nb_processed = 0;
+
+    taskqueue = open_queue(dir, nb_threads);
+
+    if (tq_queue_drain(taskqueue) == -1)
+        die("cannot drain task queue: %s", tq_get_error());
+    if (tq_queue_stop(taskqueue) == -1)
+        die("cannot stop task queue: %s", tq_get_error());
+
+    tq_queue_delete(taskqueue);
+
+    nb_replayed = state->nb_processed;
+
+    nb_dup = 0;
+    nb_lost = 0;
+    for (uint32_t i = 0; i < nb_jobs; i++) {
+        if (state->nb_runs[i] > 1)
+            nb_dup++;
+        if (state->added[i] && state->nb_runs[i] == 0)
+            nb_lost++;
+    }
+
+    printf("replayed:    %u\n", nb_replayed);
+    printf("run twice:   %u\n", nb_dup);
+    printf("lost:        %u\n", nb_lost);
+
+    if (tmp_dir)
+        remove_dir(dir);
+
+    munmap(mem, size);
+    return nb_lost > 0 ? 1 : 0;
+}
+
+static void
+usage(const char *argv0, int exit_code) {
+    printf("Usage: %s [-bdhnt]\n"
+            "\n"
+            "Options:\n"
+            "  -b <nb>    number of jobs added at once\n"
+            "  -d <dir>   journal directory (a temporary one by default,\n"
+            "             removed at exit)\n"
+            "  -h         display help\n"
+            "  -n <nb>    number of jobs\n"
+            "  -t <nb>    number of threads used\n",
+            argv0);
+    exit(exit_code);
+}
+
+static void
+die(const char *fmt, ...) {
+    va_list ap;
+
+    fprintf(stderr, "fatal error: ");
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+    putc('\n', stderr);
+    exit(1);
+}
+
+static unsigned long
+parse_ulong(const char *str, const char *name) {
+    unsigned long lval;
+
+    errno = 0;
+    lval = strtoul(str, NULL, 10);
+    if (errno)
+        die("invalid %s: %m", name);
+    if (lval > INT_MAX)
+        die("invalid %s", name);
+
+    return lval;
+}
+
+static struct tq_queue *
+open_queue(const char *dir, int nb_threads) {
+    struct tq_queue *taskqueue;
+
+    taskqueue = tq_queue_new(nb_threads);
+    if (!taskqueue)
+        die("cannot create task queue: %s", tq_get_error());
+
+    if (tq_queue_set_journal(taskqueue, dir, 0) == -1)
+        die("cannot set journal: %s", tq_get_error());
+
+    if (tq_queue_register_handler(taskqueue, HANDLER_ID, job_handler) == -1)
+        die("cannot register handler: %s", tq_get_error());
+
+    if (tq_queue_start(taskqueue) == -1)
+        die("cannot start task queue: %s", tq_get_error());
+
+    return taskqueue;
+}
+
+static void
+run_child(const char *dir, int nb_threads, uint32_t nb_jobs,
+          uint32_t batch_size) {
+    struct tq_durable_job_spec *specs;
+    struct tq_queue *taskqueue;
+    uint32_t *indexes;
+    uint64_t start;
+
+    specs = calloc(batch_size, sizeof(struct tq_durable_job_spec));
+    indexes = calloc(batch_size, sizeof(uint32_t));
+    if (!specs || !indexes)
+        die("cannot allocate batch: %m");
+
+    taskqueue = open_queue(dir, nb_threads);
+
+    start = now_ns();
+
+    for (uint32_t i = 0; i < nb_jobs; i += batch_size) {
+        uint32_t nb_specs;
+
+        nb_specs = (nb_jobs - i < batch_size) ? nb_jobs - i : batch_size;
+
+        if (nb_specs == 1) {
+            if (tq_queue_add_durable_job(taskqueue, HANDLER_ID,
+                                         &i, sizeof(uint32_t)) == -1) {
+                die("cannot add durable job: %s", tq_get_error());
+            }
+        } else {
+            for (uint32_t j = 0; j < nb_specs; j++) {
+                indexes[j] = i + j;
+
+                specs[j].handler = HANDLER_ID;
+                specs[j].payload = indexes + j;
+                specs[j].size = sizeof(uint32_t);
+            }
+
+            if (tq_queue_add_durable_jobs(taskqueue, specs, nb_specs) == -1)
+                die("cannot add durable jobs: %s", tq_get_error());
+        }
+
+        /* Jobs are on disk once they have been added */
+        for (uint32_t j = 0; j < nb_specs; j++)
+            __atomic_store_n(&state->added[i + j], 1, __ATOMIC_RELEASE);
+    }
+
+    state->add_time = now_ns() - start;
+    __atomic_store_n(&state->all_added, true, __ATOMIC_RELEASE);
+
+    /* Wait for job_handler() to end the process */
+    for (;;)
+        pause();
+}
+
+static int
+job_handler(const void *payload, size_t size) {
+    uint32_t idx, nb_processed;
+
+    if (size != sizeof(uint32_t))
+        die("invalid payload size %zu", size);
+
+    memcpy(&idx, payload, sizeof(uint32_t));
+
+    /* In the child, keep jobs pending until all of them are in the journal
+     * so that the crash leaves work behind */
+    if (state->crash_after > 0) {
+        while (!__atomic_load_n(&state->all_added, __ATOMIC_ACQUIRE))
+            sched_yield();
+    }
+
+    __atomic_add_fetch(&state->nb_runs[idx], 1, __ATOMIC_RELAXED);
+    nb_processed = __atomic_add_fetch(&state->nb_processed, 1,
+                                      __ATOMIC_RELAXED);
+
+    /* Simulate a crash: no cleanup, no pending acknowledgement written */
+    if (state->crash_after > 0 && nb_processed == state->crash_after)
+        _exit(1);
+
+    return 0;
+}
+
+static void
+remove_dir(const char *dir) {
+    struct dirent *entry;
+    char path[PATH_MAX];
+    DIR *dp;
+
+    dp = opendir(dir);
+    if (!dp)
+        die("cannot open %s: %m", dir);
+
+    while ((entry = readdir(dp))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        snprintf(path, PATH_MAX, "%s/%s", dir, entry->d_name);
+        if (unlink(path) == -1)
+            die("cannot remove %s: %m", path);
+    }
+
+    closedir(dp);
+
+    if (rmdir(dir) == -1)
+        die("cannot remove %s: %m", dir);
+}
+
+static uint64_t
+now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+}
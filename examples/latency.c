@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2013 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "taskqueue.h"
+
+/* Measure the time between the submission of a job and the moment a worker
+ * starts running it, for each idle policy. Jobs are submitted one at a
+ * time, with a pause between them so that workers become idle. */
+
+struct job {
+    uint64_t submitted;
+    uint64_t started;
+    bool done;
+};
+
+static void die(const char *, ...)
+    __attribute__((format(printf, 1, 2)));
+static void usage(const char *, int);
+static unsigned long parse_ulong(const char *, const char *);
+
+static void measure(const char *, enum tq_idle_policy, int, int, unsigned long);
+static int job_func(void *);
+
+static uint64_t now_ns(void);
+static int compare_u64(const void *, const void *);
+
+static unsigned int nb_spins = 20000;
+static unsigned int nb_yields = 100;
+
+int
+main(int argc, char **argv) {
+    int nb_threads, nb_jobs;
+    unsigned long gap;
+    int opt;
+
+    nb_threads = 1;
+    nb_jobs = 10000;
+    gap = 50;
+
+    opterr = 0;
+    while ((opt = getopt(argc, argv, "g:hn:s:t:y:")) != -1) {
+        switch (opt) {
+            case 'g':
+                gap = parse_ulong(optarg, "gap");
+                break;
+
+            case 'h':
+                usage(argv[0], 0);
+                break;
+
+            case 'n':
+                nb_jobs = (int)parse_ulong(optarg, "number of jobs");
+                break;
+
+            case 's':
+                nb_spins = (unsigned int)parse_ulong(optarg, "number of spins");
+                break;
+
+            case 't':
+                nb_threads = (int)parse_ulong(optarg, "number of threads");
+                break;
+
+            case 'y':
+                nb_yields = (unsigned int)parse_ulong(optarg,
+                                                      "number of yields");
+                break;
+
+            case '?':
+                usage(argv[0], 1);
+        }
+    }
+
+    if (nb_jobs == 0)
+        usage(argv[0], 1);
+
+    printf("%-8s %10s %10s %10s %10s\n",
+           "policy", "min (us)", "p50 (us)", "p99 (us)", "max (us)");
+
+    measure("sleep", TQ_IDLE_SLEEP, nb_threads, nb_jobs, gap);
+    measure("hybrid", TQ_IDLE_HYBRID, nb_threads, nb_jobs, gap);
+    measure("spin", TQ_IDLE_SPIN, nb_threads, nb_jobs, gap);
+
+    return 0;
+}
+
+static void
+usage(const char *argv0, int exit_code) {
+    printf("Usage: %s [-ghnsty]\n"
+            "\n"
+            "Options:\n"
+            "  -g <us>    pause between jobs in microseconds\n"
+            "  -h         display help\n"
+            "  -n <nb>    number of jobs per policy\n"
+            "  -s <nb>    number of spins of the hybrid policy\n"
+            "  -t <nb>    number of threads used\n"
+            "  -y <nb>    number of yields of the hybrid policy\n",
+            argv0);
+    exit(exit_code);
+}
+
+static void
+die(const char *fmt, ...) {
+    va_list ap;
+
+    fprintf(stderr, "fatal error: ");
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+    putc('\n', stderr);
+    exit(1);
+}
+
+static unsigned long
+parse_ulong(const char *str, const char *name) {
+    unsigned long lval;
+
+    errno = 0;
+    lval = strtoul(str, NULL, 10);
+    if (errno)
+        die("invalid %s: %m", name);
+    if (lval > INT_MAX)
+        die("invalid %s", name);
+
+    return lval;
+}
+
+static void
+measure(const char *name, enum tq_idle_policy policy, int nb_threads,
+        int nb_jobs, unsigned long gap) {
+    struct tq_queue *taskqueue;
+    uint64_t *latencies;
+    struct timespec ts;
+
+    latencies = calloc((size_t)nb_jobs, sizeof(uint64_t));
+    if (!latencies)
+        die("cannot allocate latencies: %m");
+
+    taskqueue = tq_queue_new(nb_threads);
+    if (!taskqueue)
+        die("cannot create task queue: %s", tq_get_error());
+
+    tq_queue_set_idle_policy(taskqueue, policy, nb_spins, nb_yields);
+
+    if (tq_queue_start(taskqueue) == -1)
+        die("cannot start task queue: %s", tq_get_error());
+
+    ts.tv_sec = (time_t)(gap / 1000000);
+    ts.tv_nsec = (long)(gap % 1000000) * 1000;
+
+    for (int i = 0; i < nb_jobs; i++) {
+        struct job job;
+
+        job.done = false;
+        job.submitted = now_ns();
+
+        if (tq_queue_add_job(taskqueue, job_func, &job) == -1)
+            die("cannot add job: %s", tq_get_error());
+
+        while (!__atomic_load_n(&job.done, __ATOMIC_ACQUIRE))
+            sched_yield();
+
+        latencies[i] = job.started - job.submitted;
+
+        if (gap > 0)
+            nanosleep(&ts, NULL);
+    }
+
+    if (tq_queue_stop(taskqueue) == -1)
+        die("cannot stop task queue: %s", tq_get_error());
+
+    tq_queue_delete(taskqueue);
+
+    qsort(latencies, (size_t)nb_jobs, sizeof(uint64_t), compare_u64);
+
+    printf("%-8s %10.2f %10.2f %10.2f %10.2f\n", name,
+           (double)latencies[0] / 1000.0,
+           (double)latencies[nb_jobs / 2] / 1000.0,
+           (double)latencies[(size_t)nb_jobs * 99 / 100] / 1000.0,
+           (double)latencies[nb_jobs - 1] / 1000.0);
+
+    free(latencies);
+}
+
+static int
+job_func(void *arg) {
+    struct job *job;
+
+    job = arg;
+
+    job->started = now_ns();
+    __atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static uint64_t
+now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+}
+
+static int
+compare_u64(const void *p1, const void *p2) {
+    uint64_t u1, u2;
+
+    u1 = *(const uint64_t *)p1;
+    u2 = *(const uint64_t *)p2;
+
+    return (u1 > u2) - (u1 < u2);
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2013 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include <unistd.h>
+
+#include "taskqueue.hpp"
+
+/* Use the C++ front end: submit move-only callables, get results through
+ * futures, and run a parallel loop, including one whose submissions fail
+ * partway because the memory allocator runs out. */
+
+static void usage(const char *, int);
+
+static void *failing_malloc(std::size_t);
+
+static std::atomic<long> nb_mallocs_left(-1);
+
+int
+main(int argc, char **argv) {
+    std::size_t nb_indexes;
+    int nb_threads;
+    bool failed;
+    int opt;
+
+    nb_threads = 4;
+    nb_indexes = 1000000;
+
+    opterr = 0;
+    while ((opt = getopt(argc, argv, "hn:t:")) != -1) {
+        switch (opt) {
+            case 'h':
+                usage(argv[0], 0);
+                break;
+
+            case 'n':
+                nb_indexes = std::strtoul(optarg, NULL, 10);
+                break;
+
+            case 't':
+                nb_threads = std::atoi(optarg);
+                break;
+
+            case '?':
+                usage(argv[0], 1);
+        }
+    }
+
+    if (nb_indexes == 0 || nb_threads <= 0)
+        usage(argv[0], 1);
+
+    failed = false;
+
+    struct tq_memory_allocator allocator;
+    allocator.malloc = failing_malloc;
+    allocator.free = std::free;
+    allocator.calloc = std::calloc;
+    allocator.realloc = std::realloc;
+    tq_set_memory_allocator(&allocator);
+
+    tq::queue queue(nb_threads);
+    queue.start();
+
+    /* Move-only callable and future */
+    std::unique_ptr<int> value(new int(42));
+    std::future<int> future = queue.async([&value]() { return *value * 2; });
+
+    int result = future.get();
+
+    std::printf("async:          %d\n", result);
+    if (result != 84)
+        failed = true;
+
+    /* Parallel loop */
+    std::vector<std::uint64_t> squares(nb_indexes);
+
+    queue.parallel_for(std::size_t(0), nb_indexes, [&squares](std::size_t i) {
+        squares[i] = static_cast<std::uint64_t>(i) * i;
+    });
+
+    std::size_t nb_errors = 0;
+    for (std::size_t i = 0; i < nb_indexes; i++) {
+        if (squares[i] != static_cast<std::uint64_t>(i) * i)
+            nb_errors++;
+    }
+
+    std::printf("parallel_for:   %zu wrong values\n", nb_errors);
+    if (nb_errors > 0)
+        failed = true;
+
+    /* Parallel loop whose fourth submission fails: parallel_for() must wait
+     * for the three submitted ranges before throwing, since they use the
+     * function and the latch on its stack */
+    std::atomic<std::size_t> nb_calls(0);
+
+    nb_mallocs_left = 3;
+    try {
+        queue.parallel_for(std::size_t(0), nb_indexes,
+                           [&nb_calls](std::size_t) { nb_calls++; });
+
+        std::printf("parallel_for:   no error\n");
+        failed = true;
+    } catch (const tq::error &e) {
+        std::size_t nb_expected;
+
+        nb_expected = 3 * ((nb_indexes + nb_threads * 4 - 1)
+                           / static_cast<std::size_t>(nb_threads * 4));
+        if (nb_expected > nb_indexes)
+            nb_expected = nb_indexes;
+
+        std::printf("parallel_for:   %s, %zu calls before the error "
+                    "(expected %zu)\n",
+                    e.what(), nb_calls.load(), nb_expected);
+        if (nb_calls.load() != nb_expected)
+            failed = true;
+    }
+    nb_mallocs_left = -1;
+
+    queue.stop();
+
+    return failed ? 1 : 0;
+}
+
+static void
+usage(const char *argv0, int exit_code) {
+    std::printf("Usage: %s [-hnt]\n"
+                "\n"
+                "Options:\n"
+                "  -h         display help\n"
+                "  -n <nb>    number of indexes of the parallel loop\n"
+                "  -t <nb>    number of threads used\n",
+                argv0);
+    std::exit(exit_code);
+}
+
+/* Fail once nb_mallocs_left allocations have been made, if it is not
+ * negative */
+static void *
+failing_malloc(std::size_t sz) {
+    if (nb_mallocs_left.load() >= 0 && nb_mallocs_left-- <= 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return std::malloc(sz);
+}
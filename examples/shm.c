@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2013 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "taskqueue.h"
+
+/* Dispatch jobs to worker processes through an anonymous shared memory
+ * queue. The last job kills the worker running it, which stays busy in the
+ * queue header: draining must still return once the dead worker is
+ * detected, and every other job must run exactly once. */
+
+#define HANDLER_ID 1
+
+struct job {
+    uint64_t idx;
+    bool crash;
+};
+
+static void die(const char *, ...)
+    __attribute__((format(printf, 1, 2)));
+static void usage(const char *, int);
+static unsigned long parse_ulong(const char *, const char *);
+
+static void run_worker(struct tq_shm_queue *);
+static int job_handler(const void *, size_t);
+
+static uint64_t now_ns(void);
+
+/* Shared with worker processes */
+static uint32_t *nb_runs;
+
+int
+main(int argc, char **argv) {
+    struct tq_shm_queue *queue;
+    unsigned long nb_jobs, nb_slots, nb_missing, nb_dup;
+    int nb_workers, nb_crashed;
+    uint64_t start, drain_start, end;
+    pid_t *pids;
+    int opt;
+
+    nb_workers = 2;
+    nb_jobs = 1000000;
+    nb_slots = 1024;
+
+    opterr = 0;
+    while ((opt = getopt(argc, argv, "hn:s:w:")) != -1) {
+        switch (opt) {
+            case 'h':
+                usage(argv[0], 0);
+                break;
+
+            case 'n':
+                nb_jobs = parse_ulong(optarg, "number of jobs");
+                break;
+
+            case 's':
+                nb_slots = parse_ulong(optarg, "number of slots");
+                break;
+
+            case 'w':
+                nb_workers = (int)parse_ulong(optarg, "number of workers");
+                break;
+
+            case '?':
+                usage(argv[0], 1);
+        }
+    }
+
+    if (nb_jobs == 0 || nb_slots == 0 || nb_workers == 0)
+        usage(argv[0], 1);
+
+    nb_runs = mmap(NULL, nb_jobs * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (nb_runs == MAP_FAILED)
+        die("cannot map counters: %m");
+
+    queue = tq_shm_queue_new(NULL, nb_slots, sizeof(struct job));
+    if (!queue)
+        die("cannot create shared queue: %s", tq_get_error());
+
+    pids = calloc((size_t)nb_workers, sizeof(pid_t));
+    if (!pids)
+        die("cannot allocate pids: %m");
+
+    for (int i = 0; i < nb_workers; i++) {
+        pids[i] = fork();
+        if (pids[i] == -1)
+            die("cannot fork: %m");
+        if (pids[i] == 0)
+            run_worker(queue);
+    }
+
+    start = now_ns();
+
+    /* The last job kills its worker */
+    for (unsigned long i = 0; i < nb_jobs; i++) {
+        struct job job;
+
+        memset(&job, 0, sizeof(struct job));
+        job.idx = i;
+        job.crash = (i == nb_jobs - 1);
+
+        if (tq_shm_queue_add_job(queue, HANDLER_ID,
+                                 &job, sizeof(struct job)) == -1) {
+            die("cannot add job: %s", tq_get_error());
+        }
+    }
+
+    drain_start = now_ns();
+
+    if (tq_shm_queue_drain(queue) == -1)
+        die("cannot drain shared queue: %s", tq_get_error());
+
+    end = now_ns();
+
+    if (tq_shm_queue_stop(queue) == -1)
+        die("cannot stop shared queue: %s", tq_get_error());
+
+    nb_crashed = 0;
+    for (int i = 0; i < nb_workers; i++) {
+        int status;
+
+        if (waitpid(pids[i], &status, 0) == -1)
+            die("cannot wait for worker: %m");
+
+        if (WIFSIGNALED(status))
+            nb_crashed++;
+    }
+
+    nb_missing = 0;
+    nb_dup = 0;
+    for (unsigned long i = 0; i < nb_jobs; i++) {
+        if (nb_runs[i] == 0)
+            nb_missing++;
+        if (nb_runs[i] > 1)
+            nb_dup++;
+    }
+
+    printf("jobs:           %lu\n", nb_jobs);
+    printf("workers:        %d (%d crashed)\n", nb_workers, nb_crashed);
+    printf("not run:        %lu (the crashing job)\n", nb_missing);
+    printf("run twice:      %lu\n", nb_dup);
+    printf("time:           %.3fs (drain %.3fs)\n",
+           (double)(end - start) / 1e9, (double)(end - drain_start) / 1e9);
+
+    tq_shm_queue_delete(queue);
+    free(pids);
+
+    return (nb_crashed == 1 && nb_missing == 1 && nb_dup == 0) ? 0 : 1;
+}
+
+static void
+usage(const char *argv0, int exit_code) {
+    printf("Usage: %s [-hnsw]\n"
+            "\n"
+            "Options:\n"
+            "  -h         display help\n"
+            "  -n <nb>    number of jobs\n"
+            "  -s <nb>    number of slots of the queue\n"
+            "  -w <nb>    number of worker processes\n",
+            argv0);
+    exit(exit_code);
+}
+
+static void
+die(const char *fmt, ...) {
+    va_list ap;
+
+    fprintf(stderr, "fatal error: ");
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+    putc('\n', stderr);
+    exit(1);
+}
+
+static unsigned long
+parse_ulong(const char *str, const char *name) {
+    unsigned long lval;
+
+    errno = 0;
+    lval = strtoul(str, NULL, 10);
+    if (errno)
+        die("invalid %s: %m", name);
+    if (lval > INT_MAX)
+        die("invalid %s", name);
+
+    return lval;
+}
+
+static void
+run_worker(struct tq_shm_queue *queue) {
+    if (tq_shm_queue_register_handler(queue, HANDLER_ID, job_handler) == -1)
+        die("cannot register handler: %s", tq_get_error());
+
+    if (tq_shm_queue_run(queue) == -1)
+        die("cannot run shared queue: %s", tq_get_error());
+
+    _exit(0);
+}
+
+static int
+job_handler(const void *payload, size_t size) {
+    struct job job;
+
+    if (size != sizeof(struct job))
+        die("invalid payload size %zu", size);
+
+    memcpy(&job, payload, sizeof(struct job));
+
+    /* Crash without any cleanup while the job is running, once the queue is
+     * being drained */
+    if (job.crash) {
+        struct timespec ts;
+
+        ts.tv_sec = 0;
+        ts.tv_nsec = 200000000;
+        nanosleep(&ts, NULL);
+
+        kill(getpid(), SIGKILL);
+    }
+
+    __atomic_add_fetch(&nb_runs[job.idx], 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static uint64_t
+now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+}
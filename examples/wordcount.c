@@ -14,57 +14,156 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <ctype.h>
 #include <errno.h>
 #include <limits.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#   include <immintrin.h>
+#   define WC_X86
+#endif
+
 #include "taskqueue.h"
 
+/* Mapped input is split in fixed-size jobs without looking at the content;
+ * each job decides by itself whether its first word started in the
+ * previous job */
 struct job {
     const char *ptr;
     size_t len;
+    bool first; /* first job of the input */
 };
 
+/* Input which cannot be mapped (pipes, terminals...) is streamed through a
+ * pipeline in fixed-size chunks */
+#define CHUNK_SIZE (64 * 1024)
+
+struct chunk {
+    struct chunk *next;
+
+    size_t len;
+    bool prev_space; /* last character of the previous chunk */
+    size_t nb_words;
+
+    char data[CHUNK_SIZE];
+};
+
+struct stream {
+    int fd;
+    bool prev_space;
+
+    pthread_mutex_t mutex;
+    struct chunk *free_chunks;
+};
+
+/* Count the characters starting a word in [ptr, ptr + len), prev_space
+ * indicating whether the character preceding ptr was a white space */
+typedef size_t (*count_words_func)(const char *, size_t, bool);
+
 static void die(const char *, ...)
     __attribute__((format(printf, 1, 2)));
 static void usage(const char *, int);
 
-static void map_file(const char *, char **, size_t *);
+static void map_file(const char *, int, size_t, char **);
+static void count_mapped(struct tq_queue *, const char *, size_t, size_t);
+static void count_stream(struct tq_queue *, int, int);
 static int job_func(void *);
 
-static const char *get_next_word_boundary(const char *, size_t);
+static void benchmark(const char *, size_t, size_t, int);
+static double get_time(void);
+
+static void *read_stage(void *, void *);
+static void *count_stage(void *, void *);
+static void *sum_stage(void *, void *);
+
+static void select_count_words(void);
+static size_t count_words_scalar(const char *, size_t, bool);
+#ifdef WC_X86
+#   ifdef __SSE2__
+static size_t count_words_sse2(const char *, size_t, bool);
+#   endif
+static size_t count_words_avx2(const char *, size_t, bool)
+    __attribute__((target("avx2")));
+#endif
+
+static count_words_func count_words;
+static const char *count_words_name;
 
 static size_t word_count;
 
+/* tq_queue_drain() does not wait for running jobs, so the benchmark
+ * tracks job completion itself */
+static size_t nb_pending_jobs;
+static pthread_mutex_t pending_jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_jobs_cond = PTHREAD_COND_INITIALIZER;
+
+/* Same characters as isspace() in the C locale */
+static inline bool
+is_space(char c) {
+    return c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t';
+}
+
 int
 main(int argc, char **argv) {
-    const char *path;
+    const char *path, *trace_path;
     int opt;
 
-    char *map, *ptr;
-    size_t mapsz, len;
-    size_t chunk_size;
+    struct stat st;
+    char *map;
+    int fd;
 
     struct tq_queue *taskqueue;
     int nb_threads;
+    size_t job_size;
+    bool bench;
 
     nb_threads = 4;
+    trace_path = NULL;
+    job_size = CHUNK_SIZE;
+    bench = false;
 
     opterr = 0;
-    while ((opt = getopt(argc, argv, "ht:")) != -1) {
+    while ((opt = getopt(argc, argv, "bc:hT:t:")) != -1) {
         switch (opt) {
+            case 'b':
+                bench = true;
+                break;
+
+            case 'c':
+                {
+                    unsigned long lval;
+
+                    errno = 0;
+                    lval = strtoul(optarg, NULL, 10);
+                    if (errno)
+                        die("invalid job size: %m");
+                    if (lval == 0)
+                        die("invalid job size");
+
+                    job_size = (size_t)lval;
+                    break;
+                }
+
             case 'h':
                 usage(argv[0], 0);
                 break;
 
+            case 'T':
+                trace_path = optarg;
+                break;
+
             case 't':
                 {
                     unsigned long lval;
@@ -85,45 +184,53 @@ main(int argc, char **argv) {
         }
     }
 
-    if (optind >= argc)
-        usage(argv[0], 1);
+    if (optind >= argc || strcmp(argv[optind], "-") == 0) {
+        path = "<stdin>";
+        fd = STDIN_FILENO;
+    } else {
+        path = argv[optind];
 
-    path = argv[optind];
+        fd = open(path, O_RDONLY);
+        if (fd == -1)
+            die("cannot open %s: %m", path);
+    }
 
-    map_file(path, &map, &mapsz);
+    if (fstat(fd, &st) == -1)
+        die("cannot stat %s: %m", path);
 
-    taskqueue = tq_queue_new(nb_threads);
-    if (!taskqueue)
-        die("cannot create task queue: %s", tq_get_error());
+    map = NULL;
+    if (S_ISREG(st.st_mode) && st.st_size > 0)
+        map_file(path, fd, (size_t)st.st_size, &map);
 
-    chunk_size = 4 * 1024;
-    ptr = map;
-    len = mapsz;
+    select_count_words();
 
-    if (tq_queue_start(taskqueue) == -1)
-        die("cannot start task queue: %s", tq_get_error());
+    if (bench) {
+        if (!map)
+            die("benchmark mode requires a non-empty regular file");
 
-    while (len > 0) {
-        struct job *job;
-        const char *boundary;
+        benchmark(map, (size_t)st.st_size, job_size, nb_threads);
 
-        job = malloc(sizeof(struct job));
-        if (!job)
-            die("cannot allocate job: %m");
+        munmap(map, (size_t)st.st_size);
+        close(fd);
+        return 0;
+    }
 
-        job->ptr = ptr;
-        job->len = (len >= chunk_size) ? chunk_size : len;
+    taskqueue = tq_queue_new(nb_threads);
+    if (!taskqueue)
+        die("cannot create task queue: %s", tq_get_error());
 
-        /* Make sure words are not split */
-        boundary = get_next_word_boundary(job->ptr + job->len, len - job->len);
-        if (boundary)
-            job->len = (size_t)(boundary - job->ptr);
+    if (trace_path) {
+        if (tq_queue_enable_tracing(taskqueue, 1024 * 1024) == -1)
+            die("cannot enable tracing: %s", tq_get_error());
+    }
 
-        len -= job->len;
-        ptr += job->len;
+    if (tq_queue_start(taskqueue) == -1)
+        die("cannot start task queue: %s", tq_get_error());
 
-        if (tq_queue_add_job(taskqueue, job_func, job) == -1)
-            die("cannot add job: %s", tq_get_error());
+    if (map) {
+        count_mapped(taskqueue, map, (size_t)st.st_size, job_size);
+    } else {
+        count_stream(taskqueue, fd, nb_threads * 4);
     }
 
     if (tq_queue_drain(taskqueue) == -1)
@@ -131,20 +238,35 @@ main(int argc, char **argv) {
     if (tq_queue_stop(taskqueue) == -1)
         die("cannot stop task queue: %s", tq_get_error());
 
+    if (trace_path) {
+        if (tq_queue_write_trace(taskqueue, trace_path) == -1)
+            die("cannot write trace: %s", tq_get_error());
+    }
+
     tq_queue_delete(taskqueue);
 
     printf("%zu words read\n", word_count);
 
-    munmap(map, mapsz);
+    if (map)
+        munmap(map, (size_t)st.st_size);
+    if (fd != STDIN_FILENO)
+        close(fd);
+
     return 0;
 }
 
 static void
 usage(const char *argv0, int exit_code) {
-    printf("Usage: %s [-ht] <file>\n"
+    printf("Usage: %s [-bchTt] [<file>]\n"
+            "\n"
+            "Count the words of <file>, or of the standard input if <file>\n"
+            "is absent or \"-\".\n"
             "\n"
             "Options:\n"
+            "  -b         benchmark <file> with 1 up to -t threads\n"
+            "  -c <size>  size of the jobs used for mapped files in bytes\n"
             "  -h         display help\n"
+            "  -T <path>  write a chrome trace to <path>\n"
             "  -t         number of threads used\n",
             argv0);
     exit(exit_code);
@@ -165,81 +287,410 @@ die(const char *fmt, ...) {
 }
 
 static void
-map_file(const char *path, char **pmap, size_t *psz) {
-    int fd;
-    struct stat st;
+map_file(const char *path, int fd, size_t sz, char **pmap) {
     void *map;
-    size_t sz;
-
-    fd = open(path, O_RDONLY);
-    if (fd == -1)
-        die("cannot open %s: %m", path);
-
-    if (fstat(fd, &st) == -1)
-        die("cannot stat %s: %m", path);
-
-    sz = (size_t)st.st_size;
 
     map = mmap(NULL, sz, PROT_READ, MAP_SHARED, fd, 0);
     if (map == MAP_FAILED)
         die("cannot map %s: %m", path);
 
-    close(fd);
-
     *pmap = map;
-    *psz = sz;
 }
 
-static int
-job_func(void *arg) {
-    struct job *job;
-    size_t nb_words;
+static void
+count_mapped(struct tq_queue *taskqueue, const char *map, size_t mapsz,
+             size_t job_size) {
+    const char *ptr;
+    size_t len;
 
-    job = arg;
+    ptr = map;
+    len = mapsz;
 
-    nb_words = 0;
-    while (job->len > 0) {
-        const char *boundary;
-        size_t word_len;
+    nb_pending_jobs = (mapsz + job_size - 1) / job_size;
+
+    while (len > 0) {
+        struct tq_job *tq_job;
+        struct job *job;
+
+        tq_job = tq_job_new(job_func, sizeof(struct job));
+        if (!tq_job)
+            die("cannot allocate job: %s", tq_get_error());
+
+        job = tq_job_get_data(tq_job);
+
+        job->ptr = ptr;
+        job->len = (len >= job_size) ? job_size : len;
+        job->first = (ptr == map);
+
+        len -= job->len;
+        ptr += job->len;
+
+        if (tq_queue_submit_job(taskqueue, tq_job) == -1)
+            die("cannot add job: %s", tq_get_error());
+    }
+}
+
+static void
+benchmark(const char *map, size_t mapsz, size_t job_size, int max_threads) {
+    size_t expected_count;
+
+    printf("%zu bytes, %zu byte jobs, %s kernel\n",
+           mapsz, job_size, count_words_name);
+
+    /* Also faults the mapping in so that the first run is not penalized */
+    expected_count = count_words(map, mapsz, true);
+
+    for (int nb_threads = 1; nb_threads <= max_threads;) {
+        struct tq_queue *taskqueue;
+        double start, elapsed;
+        int nb_runs;
+
+        taskqueue = tq_queue_new(nb_threads);
+        if (!taskqueue)
+            die("cannot create task queue: %s", tq_get_error());
+        if (tq_queue_start(taskqueue) == -1)
+            die("cannot start task queue: %s", tq_get_error());
+
+        /* Repeat the count for at least one second */
+        nb_runs = 0;
+        start = get_time();
+        do {
+            word_count = 0;
+
+            count_mapped(taskqueue, map, mapsz, job_size);
+
+            pthread_mutex_lock(&pending_jobs_mutex);
+            while (__sync_fetch_and_add(&nb_pending_jobs, 0) > 0)
+                pthread_cond_wait(&pending_jobs_cond, &pending_jobs_mutex);
+            pthread_mutex_unlock(&pending_jobs_mutex);
 
-        boundary = get_next_word_boundary(job->ptr, job->len);
-        if (boundary) {
-            word_len = (size_t)(boundary - job->ptr);
+            if (word_count != expected_count) {
+                die("found %zu words instead of %zu",
+                    word_count, expected_count);
+            }
+
+            nb_runs++;
+            elapsed = get_time() - start;
+        } while (elapsed < 1.0);
+
+        if (tq_queue_stop(taskqueue) == -1)
+            die("cannot stop task queue: %s", tq_get_error());
+        tq_queue_delete(taskqueue);
+
+        printf("%3d threads: %6.2f GB/s\n", nb_threads,
+               (double)mapsz * nb_runs / elapsed / 1e9);
+
+        if (nb_threads < max_threads && nb_threads * 2 > max_threads) {
+            nb_threads = max_threads;
         } else {
-            word_len = job->len;
+            nb_threads *= 2;
         }
+    }
+
+    printf("%zu words\n", expected_count);
+}
+
+static double
+get_time(void) {
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        die("cannot read clock: %m");
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void
+count_stream(struct tq_queue *taskqueue, int fd, int nb_chunks) {
+    struct tq_pipeline *pipeline;
+    struct stream stream;
+    struct chunk *chunks;
 
-        nb_words++;
+    /* There are never more chunks in use than tokens in the pipeline */
+    chunks = calloc((size_t)nb_chunks, sizeof(struct chunk));
+    if (!chunks)
+        die("cannot allocate chunks: %m");
 
-        job->ptr += word_len + 1;
-        job->len -= word_len;
+    memset(&stream, 0, sizeof(struct stream));
+
+    stream.fd = fd;
+    stream.prev_space = true;
+    pthread_mutex_init(&stream.mutex, NULL);
+
+    for (int i = 0; i < nb_chunks; i++) {
+        chunks[i].next = stream.free_chunks;
+        stream.free_chunks = chunks + i;
     }
 
-    __sync_fetch_and_add(&word_count, nb_words);
+    pipeline = tq_pipeline_new(taskqueue, nb_chunks);
+    if (!pipeline)
+        die("cannot create pipeline: %s", tq_get_error());
+
+    if (tq_pipeline_add_stage(pipeline, TQ_STAGE_SERIAL_IN_ORDER,
+                              read_stage, &stream) == -1
+     || tq_pipeline_add_stage(pipeline, TQ_STAGE_PARALLEL,
+                              count_stage, &stream) == -1
+     || tq_pipeline_add_stage(pipeline, TQ_STAGE_SERIAL_OUT_OF_ORDER,
+                              sum_stage, &stream) == -1) {
+        die("cannot add pipeline stage: %s", tq_get_error());
+    }
 
-    free(job);
-    return 0;
+    if (tq_pipeline_run(pipeline) == -1)
+        die("cannot run pipeline: %s", tq_get_error());
+
+    tq_pipeline_delete(pipeline);
+
+    pthread_mutex_destroy(&stream.mutex);
+    free(chunks);
 }
 
-static const char *
-get_next_word_boundary(const char *ptr, size_t len) {
-    /* Skip until white space */
-    while (len > 0) {
-        if (isspace((unsigned char)*ptr))
+static void *
+read_stage(void *item, void *arg) {
+    struct stream *stream;
+    struct chunk *chunk;
+
+    stream = arg;
+
+    pthread_mutex_lock(&stream->mutex);
+    chunk = stream->free_chunks;
+    stream->free_chunks = chunk->next;
+    pthread_mutex_unlock(&stream->mutex);
+
+    chunk->len = 0;
+    while (chunk->len < CHUNK_SIZE) {
+        ssize_t ret;
+
+        ret = read(stream->fd, chunk->data + chunk->len,
+                   CHUNK_SIZE - chunk->len);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+
+            die("cannot read input: %m");
+        }
+
+        if (ret == 0)
             break;
 
-        ptr++;
-        len--;
+        chunk->len += (size_t)ret;
     }
 
-    /* Skip white space until the next word */
-    while (len > 0) {
-        if (!isspace((unsigned char)*ptr))
-            return ptr;
+    if (chunk->len == 0) {
+        pthread_mutex_lock(&stream->mutex);
+        chunk->next = stream->free_chunks;
+        stream->free_chunks = chunk;
+        pthread_mutex_unlock(&stream->mutex);
 
-        ptr++;
-        len--;
+        return NULL;
     }
 
+    /* Words spanning two chunks are counted in the first one */
+    chunk->prev_space = stream->prev_space;
+    stream->prev_space = is_space(chunk->data[chunk->len - 1]);
+
+    return chunk;
+}
+
+static void *
+count_stage(void *item, void *arg) {
+    struct chunk *chunk;
+
+    chunk = item;
+    chunk->nb_words = count_words(chunk->data, chunk->len, chunk->prev_space);
+
+    return chunk;
+}
+
+static void *
+sum_stage(void *item, void *arg) {
+    struct stream *stream;
+    struct chunk *chunk;
+
+    stream = arg;
+    chunk = item;
+
+    word_count += chunk->nb_words;
+
+    pthread_mutex_lock(&stream->mutex);
+    chunk->next = stream->free_chunks;
+    stream->free_chunks = chunk;
+    pthread_mutex_unlock(&stream->mutex);
+
     return NULL;
 }
+
+static int
+job_func(void *arg) {
+    struct job *job;
+    bool prev_space;
+
+    job = arg;
+
+    /* A word starting before the job belongs to the previous one */
+    prev_space = job->first || is_space(job->ptr[-1]);
+
+    __sync_fetch_and_add(&word_count,
+                         count_words(job->ptr, job->len, prev_space));
+
+    if (__sync_sub_and_fetch(&nb_pending_jobs, 1) == 0) {
+        pthread_mutex_lock(&pending_jobs_mutex);
+        pthread_cond_signal(&pending_jobs_cond);
+        pthread_mutex_unlock(&pending_jobs_mutex);
+    }
+
+    return 0;
+}
+
+static void
+select_count_words(void) {
+    count_words = count_words_scalar;
+    count_words_name = "scalar";
+
+#ifdef WC_X86
+#   ifdef __SSE2__
+    count_words = count_words_sse2;
+    count_words_name = "sse2";
+#   endif
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        count_words = count_words_avx2;
+        count_words_name = "avx2";
+    }
+#endif
+}
+
+static size_t
+count_words_scalar(const char *ptr, size_t len, bool prev_space) {
+    size_t nb_words;
+
+    /* Count the characters starting a word */
+    nb_words = 0;
+    for (size_t i = 0; i < len; i++) {
+        bool space;
+
+        space = is_space(ptr[i]);
+        if (prev_space && !space)
+            nb_words++;
+
+        prev_space = space;
+    }
+
+    return nb_words;
+}
+
+#ifdef WC_X86
+/* The vector kernels classify each byte as 0xff (white space) or 0x00, and
+ * shift this mask by one byte to line up every character with the one
+ * before. Word starts are then subtracted (-1 each) from per-byte counters,
+ * which are summed before they can overflow, i.e. every 255 blocks. */
+
+#   ifdef __SSE2__
+static inline __m128i
+classify_sse2(__m128i v) {
+    __m128i space, ctrl;
+
+    /* Bytes >= 0x80 are negative and never match */
+    space = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+    ctrl = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('\t' - 1)),
+                         _mm_cmplt_epi8(v, _mm_set1_epi8('\r' + 1)));
+
+    return _mm_or_si128(space, ctrl);
+}
+
+static size_t
+count_words_sse2(const char *ptr, size_t len, bool prev_space) {
+    __m128i zero, prev;
+    size_t nb_words, i;
+
+    zero = _mm_setzero_si128();
+    prev = prev_space ? _mm_set1_epi8(-1) : zero;
+
+    nb_words = 0;
+    i = 0;
+
+    while (len - i >= 16) {
+        __m128i counts, sums;
+
+        counts = zero;
+        for (int n = 0; n < 255 && len - i >= 16; n++, i += 16) {
+            __m128i cur, before, starts;
+
+            cur = classify_sse2(_mm_loadu_si128((const __m128i *)(ptr + i)));
+            before = _mm_or_si128(_mm_slli_si128(cur, 1),
+                                  _mm_srli_si128(prev, 15));
+            starts = _mm_andnot_si128(cur, before);
+
+            counts = _mm_sub_epi8(counts, starts);
+            prev = cur;
+        }
+
+        sums = _mm_sad_epu8(counts, zero);
+        nb_words += (size_t)_mm_cvtsi128_si32(sums);
+        nb_words += (size_t)_mm_extract_epi16(sums, 4);
+    }
+
+    if (i > 0)
+        prev_space = is_space(ptr[i - 1]);
+
+    return nb_words + count_words_scalar(ptr + i, len - i, prev_space);
+}
+#   endif
+
+__attribute__((target("avx2")))
+static inline __m256i
+classify_avx2(__m256i v) {
+    __m256i space, ctrl;
+
+    space = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+    ctrl = _mm256_and_si256(
+        _mm256_cmpgt_epi8(v, _mm256_set1_epi8('\t' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), v));
+
+    return _mm256_or_si256(space, ctrl);
+}
+
+static size_t
+count_words_avx2(const char *ptr, size_t len, bool prev_space) {
+    __m256i zero, prev;
+    size_t nb_words, i;
+
+    zero = _mm256_setzero_si256();
+    prev = prev_space ? _mm256_set1_epi8(-1) : zero;
+
+    nb_words = 0;
+    i = 0;
+
+    while (len - i >= 32) {
+        __m256i counts, sums;
+        uint64_t lanes[4];
+
+        counts = zero;
+        for (int n = 0; n < 255 && len - i >= 32; n++, i += 32) {
+            __m256i cur, before, starts;
+
+            cur = classify_avx2(
+                _mm256_loadu_si256((const __m256i *)(ptr + i)));
+
+            /* Byte shifts do not cross 128 bit lanes: build the vector made
+             * of the high lane of prev and the low lane of cur to align
+             * against */
+            before = _mm256_alignr_epi8(
+                cur, _mm256_permute2x128_si256(prev, cur, 0x21), 15);
+            starts = _mm256_andnot_si256(cur, before);
+
+            counts = _mm256_sub_epi8(counts, starts);
+            prev = cur;
+        }
+
+        sums = _mm256_sad_epu8(counts, zero);
+        _mm256_storeu_si256((__m256i *)lanes, sums);
+        nb_words += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    if (i > 0)
+        prev_space = is_space(ptr[i - 1]);
+
+    return nb_words + count_words_scalar(ptr + i, len - i, prev_space);
+}
+#endif
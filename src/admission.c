@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2013 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include "taskqueue.h"
+#include "utils.h"
+#include "admission.h"
+
+void
+tq_admission_init(struct tq_admission *admission, double rate,
+                  uint32_t burst, uint32_t max_in_flight) {
+    admission->interval = (rate > 0.0) ? (uint64_t)(1e9 / rate) : 0;
+    if (rate > 0.0 && admission->interval == 0)
+        admission->interval = 1;
+
+    if (burst == 0)
+        burst = 1;
+    admission->tolerance = (burst - 1) * admission->interval;
+
+    admission->tat = 0;
+
+    admission->max_in_flight = max_in_flight;
+    admission->in_flight = 0;
+}
+
+/* Take an in-flight slot and a token. Returns false, leaving the state
+ * unchanged, if one of them is not available. */
+bool
+tq_admission_acquire(struct tq_admission *admission, uint64_t now) {
+    uint64_t tat, ntat;
+
+    if (admission->max_in_flight > 0) {
+        uint32_t in_flight;
+
+        in_flight = __atomic_add_fetch(&admission->in_flight, 1,
+                                       __ATOMIC_RELAXED);
+        if (in_flight > admission->max_in_flight) {
+            __atomic_sub_fetch(&admission->in_flight, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+    }
+
+    if (admission->interval == 0)
+        return true;
+
+    tat = __atomic_load_n(&admission->tat, __ATOMIC_RELAXED);
+    do {
+        /* The bucket is empty if the next job is expected later than the
+         * burst allows */
+        if (tat > now + admission->tolerance) {
+            if (admission->max_in_flight > 0)
+                __atomic_sub_fetch(&admission->in_flight, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+
+        ntat = ((tat > now) ? tat : now) + admission->interval;
+    } while (!__atomic_compare_exchange_n(&admission->tat, &tat, ntat, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return true;
+}
+
+/* Undo a successful acquisition for a job which was not queued */
+void
+tq_admission_cancel(struct tq_admission *admission) {
+    if (admission->interval > 0) {
+        __atomic_sub_fetch(&admission->tat, admission->interval,
+                           __ATOMIC_RELAXED);
+    }
+
+    tq_admission_release(admission);
+}
+
+/* Release the in-flight slot of a job once it has run */
+void
+tq_admission_release(struct tq_admission *admission) {
+    if (admission->max_in_flight > 0)
+        __atomic_sub_fetch(&admission->in_flight, 1, __ATOMIC_RELAXED);
+}
+
+/* Check without modifying the state whether a job could currently be
+ * admitted */
+bool
+tq_admission_available(struct tq_admission *admission, uint64_t now) {
+    if (admission->max_in_flight > 0
+     && __atomic_load_n(&admission->in_flight, __ATOMIC_RELAXED)
+            >= admission->max_in_flight) {
+        return false;
+    }
+
+    if (admission->interval > 0
+     && __atomic_load_n(&admission->tat, __ATOMIC_RELAXED)
+            > now + admission->tolerance) {
+        return false;
+    }
+
+    return true;
+}
+
+/* Return the time at which the next token will be available, or 0 if
+ * admission does not depend on time: there is no rate limit, or all
+ * in-flight slots are taken and a job has to complete first. */
+uint64_t
+tq_admission_next_token(struct tq_admission *admission) {
+    uint64_t tat;
+
+    if (admission->interval == 0)
+        return 0;
+
+    if (admission->max_in_flight > 0
+     && __atomic_load_n(&admission->in_flight, __ATOMIC_RELAXED)
+            >= admission->max_in_flight) {
+        return 0;
+    }
+
+    tat = __atomic_load_n(&admission->tat, __ATOMIC_RELAXED);
+    if (tat <= admission->tolerance)
+        return 1;
+
+    return tat - admission->tolerance;
+}
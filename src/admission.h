@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2013 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBTASKQUEUE_ADMISSION_H
+#define LIBTASKQUEUE_ADMISSION_H
+
+/* Admission limits of a queue or of a job class. The rate limit is a token
+ * bucket implemented with the generic cell rate algorithm: the state is the
+ * theoretical arrival time of the next job, updated with a single
+ * compare-and-swap. Both limits are lock-free. */
+struct tq_admission {
+    uint64_t interval;  /* nanoseconds per token, 0 without rate limit */
+    uint64_t tolerance; /* (burst - 1) * interval */
+    uint64_t tat;
+
+    uint32_t max_in_flight; /* 0 without cap */
+    uint32_t in_flight;
+};
+
+void tq_admission_init(struct tq_admission *admission, double rate,
+                       uint32_t burst, uint32_t max_in_flight);
+
+bool tq_admission_acquire(struct tq_admission *admission, uint64_t now);
+void tq_admission_cancel(struct tq_admission *admission);
+void tq_admission_release(struct tq_admission *admission);
+
+bool tq_admission_available(struct tq_admission *admission, uint64_t now);
+uint64_t tq_admission_next_token(struct tq_admission *admission);
+
+#endif
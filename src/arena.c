@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2013 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "taskqueue.h"
+#include "utils.h"
+#include "arena.h"
+
+#define TQ_ARENA_ALIGNMENT 16U
+#define TQ_HUGEPAGE_SIZE   (2U * 1024 * 1024)
+
+struct tq_arena_block {
+    struct tq_arena_block *next;
+
+    size_t size; /* usable size */
+    size_t mapsz; /* mapping size for hugepage blocks, 0 otherwise */
+
+    char data[] __attribute__((aligned(TQ_ARENA_ALIGNMENT)));
+};
+
+static struct tq_arena_block *tq_arena_block_new(struct tq_arena *, size_t);
+static void tq_arena_block_delete(struct tq_arena_block *);
+
+void
+tq_arena_init(struct tq_arena *arena, size_t block_size, bool hugepages) {
+    memset(arena, 0, sizeof(struct tq_arena));
+
+    arena->block_size = block_size;
+    arena->hugepages = hugepages;
+}
+
+void
+tq_arena_free(struct tq_arena *arena) {
+    struct tq_arena_block *block;
+
+    block = arena->blocks;
+    while (block) {
+        struct tq_arena_block *next;
+
+        next = block->next;
+        tq_arena_block_delete(block);
+        block = next;
+    }
+
+    arena->blocks = NULL;
+    arena->current = NULL;
+    arena->offset = 0;
+}
+
+void *
+tq_arena_alloc(struct tq_arena *arena, size_t sz) {
+    struct tq_arena_block *block;
+    void *ptr;
+
+    if (sz > SIZE_MAX - (TQ_ARENA_ALIGNMENT - 1)) {
+        tq_set_error("arena allocation too large");
+        return NULL;
+    }
+
+    sz = (sz + TQ_ARENA_ALIGNMENT - 1) & ~(size_t)(TQ_ARENA_ALIGNMENT - 1);
+
+    block = arena->current;
+    if (block && block->size - arena->offset >= sz) {
+        ptr = block->data + arena->offset;
+        arena->offset += sz;
+        return ptr;
+    }
+
+    /* Move to the next block if there is one large enough, or insert a new
+     * block after the current one */
+    if (block && block->next && block->next->size >= sz) {
+        block = block->next;
+    } else {
+        struct tq_arena_block *nblock;
+
+        nblock = tq_arena_block_new(arena, sz);
+        if (!nblock)
+            return NULL;
+
+        if (block) {
+            nblock->next = block->next;
+            block->next = nblock;
+        } else {
+            nblock->next = arena->blocks;
+            arena->blocks = nblock;
+        }
+
+        block = nblock;
+    }
+
+    arena->current = block;
+    arena->offset = sz;
+    return block->data;
+}
+
+void
+tq_arena_reset(struct tq_arena *arena) {
+    arena->current = arena->blocks;
+    arena->offset = 0;
+}
+
+static struct tq_arena_block *
+tq_arena_block_new(struct tq_arena *arena, size_t sz) {
+    struct tq_arena_block *block;
+    size_t size;
+
+    size = (arena->block_size > sz) ? arena->block_size : sz;
+
+    if (size > SIZE_MAX - sizeof(struct tq_arena_block) - TQ_HUGEPAGE_SIZE) {
+        tq_set_error("arena block too large");
+        return NULL;
+    }
+
+#ifdef MAP_HUGETLB
+    if (arena->hugepages) {
+        size_t mapsz;
+        void *map;
+
+        mapsz = sizeof(struct tq_arena_block) + size;
+        mapsz = (mapsz + TQ_HUGEPAGE_SIZE - 1) & ~(size_t)(TQ_HUGEPAGE_SIZE - 1);
+
+        map = mmap(NULL, mapsz, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (map != MAP_FAILED) {
+            block = map;
+            block->next = NULL;
+            block->size = mapsz - sizeof(struct tq_arena_block);
+            block->mapsz = mapsz;
+            return block;
+        }
+
+        /* No hugepage available, fall back to the memory allocator */
+    }
+#endif
+
+    block = tq_malloc(sizeof(struct tq_arena_block) + size);
+    if (!block) {
+        tq_set_error("cannot allocate arena block: %m");
+        return NULL;
+    }
+
+    block->next = NULL;
+    block->size = size;
+    block->mapsz = 0;
+
+    return block;
+}
+
+static void
+tq_arena_block_delete(struct tq_arena_block *block) {
+    if (block->mapsz > 0) {
+        munmap(block, block->mapsz);
+    } else {
+        tq_free(block);
+    }
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2013 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBTASKQUEUE_ARENA_H
+#define LIBTASKQUEUE_ARENA_H
+
+struct tq_arena_block;
+
+/* A bump-pointer arena. Blocks are allocated on demand and kept when the
+ * arena is reset, so that a warm arena never calls the allocator. */
+struct tq_arena {
+    struct tq_arena_block *blocks;
+    struct tq_arena_block *current;
+    size_t offset;
+
+    size_t block_size;
+    bool hugepages;
+};
+
+void tq_arena_init(struct tq_arena *arena, size_t block_size, bool hugepages);
+void tq_arena_free(struct tq_arena *arena);
+
+void *tq_arena_alloc(struct tq_arena *arena, size_t sz);
+void tq_arena_reset(struct tq_arena *arena);
+
+#endif
@@ -0,0 +1,786 @@
+/*
+ * Copyright (c) 2013 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "taskqueue.h"
+#include "utils.h"
+#include "journal.h"
+
+/* The journal is a directory of fixed-size segment files, each one mapped
+ * in memory. Records are appended to the last segment; a new segment is
+ * created when it is full. Job records are acknowledged by ack records
+ * once processed, and segments are deleted, oldest first, when all their
+ * jobs have been acknowledged.
+ *
+ * Appending a job is made durable by group commit: the first producer
+ * waiting for its record to reach the disk syncs the segment on behalf of
+ * all records appended so far, while other producers wait for it. Ack
+ * records are never synced on their own; a crash can therefore cause an
+ * already processed job to be replayed. */
+
+#define TQ_JOURNAL_SUFFIX ".journal"
+
+enum tq_journal_record_type {
+    TQ_JOURNAL_RECORD_JOB = 1,
+    TQ_JOURNAL_RECORD_ACK = 2,
+};
+
+struct tq_journal_record {
+    uint32_t checksum;
+    uint32_t type;
+    uint64_t seq;
+    uint32_t handler;
+    uint32_t size;
+    char payload[];
+};
+
+struct tq_journal_segment {
+    uint64_t id;
+
+    char *map;
+    size_t offset;
+    size_t synced;
+
+    uint64_t nb_pending;
+};
+
+struct tq_journal_entry {
+    uint64_t seq;
+    uint32_t handler;
+    uint32_t size;
+    char *payload;
+    bool acked;
+};
+
+struct tq_journal {
+    char *dir;
+    size_t segment_size;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    struct tq_journal_segment *segments; /* oldest first */
+    size_t nb_segments;
+
+    uint64_t next_seq;
+
+    /* Log sequence numbers, i.e. positions in the whole journal */
+    uint64_t written;
+    uint64_t synced;
+    bool syncing;
+};
+
+static int tq_journal_recover(struct tq_journal *, struct tq_journal_entry **,
+                              size_t *, uint64_t *);
+static int tq_journal_read_segment(struct tq_journal *, uint64_t,
+                                   struct tq_journal_entry **, size_t *);
+static int tq_journal_add_segment(struct tq_journal *, uint64_t);
+static int tq_journal_remove_segment(struct tq_journal *);
+static int tq_journal_reserve(struct tq_journal *, size_t);
+static void tq_journal_write(struct tq_journal *, uint32_t, uint64_t,
+                             uint32_t, const void *, size_t);
+static int tq_journal_sync_segment(struct tq_journal *,
+                                   struct tq_journal_segment *, size_t);
+
+static void tq_journal_segment_path(const struct tq_journal *, uint64_t,
+                                    char *);
+static size_t tq_journal_record_size(size_t);
+static uint32_t tq_journal_checksum(const struct tq_journal_record *);
+
+static inline uint64_t
+tq_journal_lsn(const struct tq_journal *journal,
+               const struct tq_journal_segment *segment, size_t offset) {
+    return segment->id * journal->segment_size + offset;
+}
+
+static inline struct tq_journal_segment *
+tq_journal_current_segment(struct tq_journal *journal) {
+    return journal->segments + journal->nb_segments - 1;
+}
+
+struct tq_journal *
+tq_journal_open(const char *dir, size_t segment_size,
+                tq_journal_replay_func func, void *arg) {
+    struct tq_journal *journal;
+    struct tq_journal_entry *entries;
+    size_t nb_entries, nb_old_segments, len;
+    uint64_t next_id;
+    bool created;
+
+    if (segment_size < tq_journal_record_size(0) * 2) {
+        tq_set_error("journal segment size too small");
+        return NULL;
+    }
+
+    journal = tq_malloc(sizeof(struct tq_journal));
+    if (!journal) {
+        tq_set_error("cannot allocate journal: %m");
+        return NULL;
+    }
+
+    memset(journal, 0, sizeof(struct tq_journal));
+
+    journal->segment_size = segment_size;
+
+    len = strlen(dir);
+    journal->dir = tq_malloc(len + 1);
+    if (!journal->dir) {
+        tq_set_error("cannot allocate journal directory: %m");
+        tq_free(journal);
+        return NULL;
+    }
+    memcpy(journal->dir, dir, len + 1);
+
+    if (tq_mutex_init(&journal->mutex) == -1) {
+        tq_free(journal->dir);
+        tq_free(journal);
+        return NULL;
+    }
+
+    pthread_cond_init(&journal->cond, NULL);
+
+    /* Read existing segments; they are kept mapped read-only until pending
+     * jobs have been copied to a new segment */
+    entries = NULL;
+    nb_entries = 0;
+    created = false;
+
+    if (tq_journal_recover(journal, &entries, &nb_entries, &next_id) == -1)
+        goto error;
+
+    nb_old_segments = journal->nb_segments;
+
+    if (tq_journal_add_segment(journal, next_id) == -1)
+        goto error;
+    created = true;
+
+    for (size_t i = 0; i < nb_entries; i++) {
+        struct tq_journal_entry *entry;
+
+        entry = entries + i;
+        if (entry->acked)
+            continue;
+
+        if (func(journal, arg, entry->handler, entry->payload,
+                 entry->size) == -1) {
+            goto error;
+        }
+    }
+
+    if (tq_journal_sync(journal) == -1)
+        goto error;
+
+    /* The new segment now holds all pending jobs and must be kept even if
+     * old segments cannot be removed; jobs of the remaining old segments
+     * would only be replayed twice */
+    created = false;
+
+    for (size_t i = 0; i < nb_old_segments; i++) {
+        if (tq_journal_remove_segment(journal) == -1)
+            goto error;
+    }
+
+    for (size_t i = 0; i < nb_entries; i++)
+        tq_free(entries[i].payload);
+    tq_free(entries);
+
+    return journal;
+
+error:
+    for (size_t i = 0; i < nb_entries; i++)
+        tq_free(entries[i].payload);
+    tq_free(entries);
+
+    /* Only unlink segments we created, previous segments must be kept for
+     * the next recovery */
+    if (created) {
+        for (size_t i = 0; i < journal->nb_segments; i++) {
+            char path[PATH_MAX];
+
+            if (journal->segments[i].id < next_id)
+                continue;
+
+            tq_journal_segment_path(journal, journal->segments[i].id, path);
+            unlink(path);
+        }
+    }
+
+    tq_journal_close(journal);
+    return NULL;
+}
+
+void
+tq_journal_close(struct tq_journal *journal) {
+    if (!journal)
+        return;
+
+    for (size_t i = 0; i < journal->nb_segments; i++) {
+        struct tq_journal_segment *segment;
+
+        segment = journal->segments + i;
+
+        msync(segment->map, segment->offset, MS_SYNC);
+        munmap(segment->map, journal->segment_size);
+    }
+
+    tq_free(journal->segments);
+
+    pthread_cond_destroy(&journal->cond);
+    tq_mutex_free(&journal->mutex);
+
+    tq_free(journal->dir);
+    tq_free(journal);
+}
+
+int
+tq_journal_append(struct tq_journal *journal, uint32_t handler,
+                  const void *payload, size_t size, bool sync,
+                  struct tq_journal_ref *ref) {
+    struct tq_journal_segment *segment;
+    uint64_t lsn;
+
+    if (size > UINT32_MAX
+     || tq_journal_record_size(size) > journal->segment_size) {
+        tq_set_error("payload too large for journal segments");
+        return -1;
+    }
+
+    if (tq_mutex_lock(&journal->mutex) == -1)
+        return -1;
+
+    if (tq_journal_reserve(journal, tq_journal_record_size(size)) == -1) {
+        tq_mutex_unlock(&journal->mutex);
+        return -1;
+    }
+
+    /* Sequence numbers are allocated once space is reserved so that they
+     * increase along the journal */
+    ref->seq = journal->next_seq++;
+
+    tq_journal_write(journal, TQ_JOURNAL_RECORD_JOB, ref->seq, handler,
+                     payload, size);
+
+    segment = tq_journal_current_segment(journal);
+    segment->nb_pending++;
+
+    ref->segment = segment->id;
+    lsn = journal->written;
+
+    if (!sync) {
+        tq_mutex_unlock(&journal->mutex);
+        return 0;
+    }
+
+    while (journal->synced < lsn) {
+        size_t offset;
+        int ret;
+
+        if (journal->syncing) {
+            pthread_cond_wait(&journal->cond, &journal->mutex);
+            continue;
+        }
+
+        /* Become the leader and sync everything written so far */
+        segment = tq_journal_current_segment(journal);
+        offset = segment->offset;
+        lsn = journal->written;
+
+        journal->syncing = true;
+        ret = tq_journal_sync_segment(journal, segment, offset);
+        journal->syncing = false;
+
+        pthread_cond_broadcast(&journal->cond);
+
+        if (ret == -1) {
+            tq_mutex_unlock(&journal->mutex);
+            return -1;
+        }
+    }
+
+    tq_mutex_unlock(&journal->mutex);
+    return 0;
+}
+
+int
+tq_journal_ack(struct tq_journal *journal, const struct tq_journal_ref *ref) {
+    struct tq_journal_segment *segment;
+    int ret;
+
+    if (tq_mutex_lock(&journal->mutex) == -1)
+        return -1;
+
+    ret = tq_journal_reserve(journal, tq_journal_record_size(0));
+    if (ret == 0)
+        tq_journal_write(journal, TQ_JOURNAL_RECORD_ACK, ref->seq, 0, NULL, 0);
+
+    segment = journal->segments + (ref->segment - journal->segments[0].id);
+    segment->nb_pending--;
+
+    /* Delete fully acknowledged segments, oldest first; acks live in later
+     * segments, so they are never deleted before the jobs they refer to */
+    while (journal->nb_segments > 1 && journal->segments[0].nb_pending == 0) {
+        if (tq_journal_remove_segment(journal) == -1) {
+            ret = -1;
+            break;
+        }
+    }
+
+    tq_mutex_unlock(&journal->mutex);
+    return ret;
+}
+
+int
+tq_journal_sync(struct tq_journal *journal) {
+    struct tq_journal_segment *segment;
+    int ret;
+
+    if (tq_mutex_lock(&journal->mutex) == -1)
+        return -1;
+
+    while (journal->syncing)
+        pthread_cond_wait(&journal->cond, &journal->mutex);
+
+    segment = tq_journal_current_segment(journal);
+    journal->syncing = true;
+    ret = tq_journal_sync_segment(journal, segment, segment->offset);
+    journal->syncing = false;
+
+    pthread_cond_broadcast(&journal->cond);
+
+    tq_mutex_unlock(&journal->mutex);
+    return ret;
+}
+
+static int
+tq_journal_recover(struct tq_journal *journal,
+                   struct tq_journal_entry **pentries, size_t *pnb_entries,
+                   uint64_t *pnext_id) {
+    DIR *dir;
+    struct dirent *dirent;
+    uint64_t *ids;
+    size_t nb_ids;
+    uint64_t next_id;
+
+    dir = opendir(journal->dir);
+    if (!dir) {
+        tq_set_error("cannot open directory %s: %m", journal->dir);
+        return -1;
+    }
+
+    ids = NULL;
+    nb_ids = 0;
+    next_id = 0;
+
+    while ((dirent = readdir(dir))) {
+        const char *name, *suffix;
+        uint64_t id, *nids;
+        char *end;
+        size_t i;
+
+        name = dirent->d_name;
+
+        suffix = strchr(name, '.');
+        if (!suffix || strcmp(suffix, TQ_JOURNAL_SUFFIX) != 0)
+            continue;
+
+        errno = 0;
+        id = strtoull(name, &end, 16);
+        if (errno || end != suffix)
+            continue;
+
+        nids = tq_realloc(ids, (nb_ids + 1) * sizeof(uint64_t));
+        if (!nids) {
+            tq_set_error("cannot allocate segment list: %m");
+            tq_free(ids);
+            closedir(dir);
+            return -1;
+        }
+
+        ids = nids;
+
+        /* Keep identifiers sorted */
+        i = nb_ids;
+        while (i > 0 && ids[i - 1] > id) {
+            ids[i] = ids[i - 1];
+            i--;
+        }
+        ids[i] = id;
+        nb_ids++;
+
+        if (id >= next_id)
+            next_id = id + 1;
+    }
+
+    closedir(dir);
+
+    for (size_t i = 0; i < nb_ids; i++) {
+        if (tq_journal_read_segment(journal, ids[i],
+                                    pentries, pnb_entries) == -1) {
+            tq_free(ids);
+            return -1;
+        }
+    }
+
+    tq_free(ids);
+
+    *pnext_id = next_id;
+    return 0;
+}
+
+static int
+tq_journal_read_segment(struct tq_journal *journal, uint64_t id,
+                        struct tq_journal_entry **pentries,
+                        size_t *pnb_entries) {
+    struct tq_journal_segment *segment;
+    size_t offset;
+
+    if (tq_journal_add_segment(journal, id) == -1)
+        return -1;
+
+    segment = tq_journal_current_segment(journal);
+
+    offset = 0;
+    while (offset + tq_journal_record_size(0) <= journal->segment_size) {
+        const struct tq_journal_record *record;
+        size_t record_size;
+
+        record = (const struct tq_journal_record *)(segment->map + offset);
+        if (record->type == 0)
+            break;
+
+        record_size = tq_journal_record_size(record->size);
+        if (offset + record_size > journal->segment_size
+         || tq_journal_checksum(record) != record->checksum) {
+            /* Torn write, the rest of the segment was never synced */
+            break;
+        }
+
+        if (record->type == TQ_JOURNAL_RECORD_JOB) {
+            struct tq_journal_entry *entries, *entry;
+
+            entries = tq_realloc(*pentries, (*pnb_entries + 1)
+                                          * sizeof(struct tq_journal_entry));
+            if (!entries) {
+                tq_set_error("cannot allocate journal entries: %m");
+                return -1;
+            }
+
+            *pentries = entries;
+
+            entry = entries + *pnb_entries;
+            memset(entry, 0, sizeof(struct tq_journal_entry));
+
+            entry->seq = record->seq;
+            entry->handler = record->handler;
+            entry->size = record->size;
+
+            entry->payload = tq_malloc(record->size + 1);
+            if (!entry->payload) {
+                tq_set_error("cannot allocate journal entry: %m");
+                return -1;
+            }
+            memcpy(entry->payload, record->payload, record->size);
+
+            (*pnb_entries)++;
+        } else if (record->type == TQ_JOURNAL_RECORD_ACK) {
+            struct tq_journal_entry *entries;
+            size_t lo, hi;
+
+            /* Entries are sorted by sequence number */
+            entries = *pentries;
+            lo = 0;
+            hi = *pnb_entries;
+            while (lo < hi) {
+                size_t mid;
+
+                mid = lo + (hi - lo) / 2;
+                if (entries[mid].seq < record->seq) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+
+            if (lo < *pnb_entries && entries[lo].seq == record->seq)
+                entries[lo].acked = true;
+        }
+
+        if (record->seq >= journal->next_seq)
+            journal->next_seq = record->seq + 1;
+
+        offset += record_size;
+    }
+
+    return 0;
+}
+
+static int
+tq_journal_add_segment(struct tq_journal *journal, uint64_t id) {
+    struct tq_journal_segment *segments, *segment;
+    char path[PATH_MAX];
+    struct stat st;
+    bool created;
+    void *map;
+    int fd;
+
+    tq_journal_segment_path(journal, id, path);
+
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+        tq_set_error("cannot open %s: %m", path);
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        tq_set_error("cannot stat %s: %m", path);
+        close(fd);
+        return -1;
+    }
+
+    created = (st.st_size == 0);
+
+    if ((size_t)st.st_size != journal->segment_size) {
+        if (!created) {
+            tq_set_error("invalid segment size for %s", path);
+            close(fd);
+            return -1;
+        }
+
+        if (ftruncate(fd, (off_t)journal->segment_size) == -1) {
+            tq_set_error("cannot truncate %s: %m", path);
+            close(fd);
+            return -1;
+        }
+
+        if (fsync(fd) == -1) {
+            tq_set_error("cannot sync %s: %m", path);
+            close(fd);
+            return -1;
+        }
+    }
+
+    map = mmap(NULL, journal->segment_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        tq_set_error("cannot map %s: %m", path);
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    if (created) {
+        int dirfd;
+
+        /* Make sure the new file survives a crash */
+        dirfd = open(journal->dir, O_RDONLY);
+        if (dirfd >= 0) {
+            fsync(dirfd);
+            close(dirfd);
+        }
+    }
+
+    segments = tq_realloc(journal->segments, (journal->nb_segments + 1)
+                                           * sizeof(struct tq_journal_segment));
+    if (!segments) {
+        tq_set_error("cannot allocate segment: %m");
+        munmap(map, journal->segment_size);
+        return -1;
+    }
+
+    journal->segments = segments;
+
+    segment = segments + journal->nb_segments;
+    memset(segment, 0, sizeof(struct tq_journal_segment));
+
+    segment->id = id;
+    segment->map = map;
+
+    journal->nb_segments++;
+
+    journal->written = tq_journal_lsn(journal, segment, 0);
+    journal->synced = journal->written;
+
+    return 0;
+}
+
+static int
+tq_journal_remove_segment(struct tq_journal *journal) {
+    struct tq_journal_segment *segment;
+    char path[PATH_MAX];
+
+    segment = journal->segments;
+
+    tq_journal_segment_path(journal, segment->id, path);
+    if (unlink(path) == -1) {
+        tq_set_error("cannot unlink %s: %m", path);
+        return -1;
+    }
+
+    munmap(segment->map, journal->segment_size);
+
+    memmove(journal->segments, journal->segments + 1,
+            (journal->nb_segments - 1) * sizeof(struct tq_journal_segment));
+    journal->nb_segments--;
+
+    return 0;
+}
+
+static int
+tq_journal_reserve(struct tq_journal *journal, size_t record_size) {
+    struct tq_journal_segment *segment;
+
+    for (;;) {
+        uint64_t id;
+        int ret;
+
+        segment = tq_journal_current_segment(journal);
+        if (segment->offset + record_size <= journal->segment_size)
+            break;
+
+        if (journal->syncing) {
+            pthread_cond_wait(&journal->cond, &journal->mutex);
+            continue;
+        }
+
+        /* The segment is full: make it durable and start a new one */
+        id = segment->id;
+
+        journal->syncing = true;
+        ret = tq_journal_sync_segment(journal, segment, segment->offset);
+        if (ret == 0)
+            ret = tq_journal_add_segment(journal, id + 1);
+        journal->syncing = false;
+
+        pthread_cond_broadcast(&journal->cond);
+
+        if (ret == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void
+tq_journal_write(struct tq_journal *journal, uint32_t type, uint64_t seq,
+                 uint32_t handler, const void *payload, size_t size) {
+    struct tq_journal_segment *segment;
+    struct tq_journal_record *record;
+
+    segment = tq_journal_current_segment(journal);
+    record = (struct tq_journal_record *)(segment->map + segment->offset);
+
+    record->type = type;
+    record->seq = seq;
+    record->handler = handler;
+    record->size = (uint32_t)size;
+    if (size > 0)
+        memcpy(record->payload, payload, size);
+    record->checksum = tq_journal_checksum(record);
+
+    segment->offset += tq_journal_record_size(size);
+    journal->written = tq_journal_lsn(journal, segment, segment->offset);
+}
+
+static int
+tq_journal_sync_segment(struct tq_journal *journal,
+                        struct tq_journal_segment *segment, size_t offset) {
+    size_t page_size, start;
+    uint64_t id, lsn;
+    char *map;
+    int ret;
+
+    if (offset <= segment->synced)
+        return 0;
+
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+    start = segment->synced & ~(page_size - 1);
+
+    /* The segment array can be reallocated while the mutex is released,
+     * but the segment being synced cannot be removed since it contains
+     * pending jobs */
+    id = segment->id;
+    map = segment->map;
+    lsn = tq_journal_lsn(journal, segment, offset);
+
+    tq_mutex_unlock(&journal->mutex);
+    ret = msync(map + start, offset - start, MS_SYNC);
+    tq_mutex_lock(&journal->mutex);
+
+    if (ret == -1) {
+        tq_set_error("cannot sync journal: %m");
+        return -1;
+    }
+
+    segment = journal->segments + (id - journal->segments[0].id);
+    if (offset > segment->synced)
+        segment->synced = offset;
+
+    if (lsn > journal->synced)
+        journal->synced = lsn;
+
+    return 0;
+}
+
+static void
+tq_journal_segment_path(const struct tq_journal *journal, uint64_t id,
+                        char *path) {
+    snprintf(path, PATH_MAX, "%s/%016" PRIx64 TQ_JOURNAL_SUFFIX,
+             journal->dir, id);
+}
+
+static size_t
+tq_journal_record_size(size_t size) {
+    size_t record_size;
+
+    record_size = sizeof(struct tq_journal_record) + size;
+    return (record_size + 7) & ~(size_t)7;
+}
+
+static uint32_t
+tq_journal_checksum(const struct tq_journal_record *record) {
+    const unsigned char *ptr;
+    size_t len;
+    uint32_t hash;
+
+    /* FNV-1a over everything but the checksum itself */
+    ptr = (const unsigned char *)record + sizeof(record->checksum);
+    len = sizeof(struct tq_journal_record) - sizeof(record->checksum)
+        + record->size;
+
+    hash = 2166136261U;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= ptr[i];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
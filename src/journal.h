@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2013 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBTASKQUEUE_JOURNAL_H
+#define LIBTASKQUEUE_JOURNAL_H
+
+struct tq_journal;
+
+/* Identifies a job record in the journal, used to acknowledge it */
+struct tq_journal_ref {
+    uint64_t seq;
+    uint64_t segment;
+};
+
+typedef int (*tq_journal_replay_func)(struct tq_journal *, void *,
+                                      uint32_t, const void *, size_t);
+
+struct tq_journal *tq_journal_open(const char *dir, size_t segment_size,
+                                   tq_journal_replay_func func, void *arg);
+void tq_journal_close(struct tq_journal *journal);
+
+int tq_journal_append(struct tq_journal *journal, uint32_t handler,
+                      const void *payload, size_t size, bool sync,
+                      struct tq_journal_ref *ref);
+int tq_journal_ack(struct tq_journal *journal,
+                   const struct tq_journal_ref *ref);
+int tq_journal_sync(struct tq_journal *journal);
+
+#endif
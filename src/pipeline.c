@@ -0,0 +1,406 @@
+/*
+ * Copyright (c) 2013 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "taskqueue.h"
+#include "utils.h"
+
+/* A pipeline runs items through a sequence of stages, using jobs of a task
+ * queue. Each item travels with a token; the number of tokens bounds the
+ * number of items in flight, and therefore the memory used by the
+ * pipeline.
+ *
+ * The first stage produces items and is always run serially, in order.
+ * A token which cannot enter a serial stage (because another token is in
+ * it, or because it is not its turn) is parked in the stage; the token
+ * leaving the stage hands it over to the next eligible token, which is
+ * resumed in a new job. */
+
+struct tq_pipeline_token {
+    struct tq_pipeline *pipeline;
+
+    void *item;
+    uint64_t seq;
+
+    int stage;
+    bool owns_stage;
+
+    struct tq_pipeline_token *next;
+};
+
+struct tq_pipeline_stage {
+    enum tq_stage_mode mode;
+    tq_stage_func func;
+    void *arg;
+
+    pthread_mutex_t mutex;
+    bool busy;
+    uint64_t next_seq;
+
+    /* Parked tokens, sorted by sequence number for in-order stages */
+    struct tq_pipeline_token *waiting;
+};
+
+struct tq_pipeline {
+    struct tq_queue *queue;
+
+    struct tq_pipeline_stage *stages;
+    int nb_stages;
+
+    struct tq_pipeline_token *tokens;
+    int nb_tokens;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    struct tq_pipeline_token *free_tokens;
+    int nb_active_tokens;
+    uint64_t next_seq;
+
+    bool input_done;
+    bool input_stalled;
+};
+
+static void tq_pipeline_submit(struct tq_pipeline_token *);
+static int tq_pipeline_token_func(void *);
+static void tq_pipeline_input(struct tq_pipeline_token *);
+static void tq_pipeline_process(struct tq_pipeline_token *);
+static void tq_pipeline_release(struct tq_pipeline_token *);
+
+struct tq_pipeline *
+tq_pipeline_new(struct tq_queue *queue, int max_tokens) {
+    struct tq_pipeline *pipeline;
+    int err;
+
+    if (max_tokens < 1) {
+        tq_set_error("invalid number of tokens");
+        return NULL;
+    }
+
+    pipeline = tq_malloc(sizeof(struct tq_pipeline));
+    if (!pipeline) {
+        tq_set_error("cannot allocate pipeline: %m");
+        return NULL;
+    }
+
+    memset(pipeline, 0, sizeof(struct tq_pipeline));
+
+    pipeline->queue = queue;
+
+    pipeline->nb_tokens = max_tokens;
+    pipeline->tokens = tq_calloc((size_t)max_tokens,
+                                 sizeof(struct tq_pipeline_token));
+    if (!pipeline->tokens) {
+        tq_set_error("cannot allocate pipeline tokens: %m");
+        tq_free(pipeline);
+        return NULL;
+    }
+
+    if (tq_mutex_init(&pipeline->mutex) == -1) {
+        tq_free(pipeline->tokens);
+        tq_free(pipeline);
+        return NULL;
+    }
+
+    err = pthread_cond_init(&pipeline->cond, NULL);
+    if (err) {
+        tq_set_error("cannot create condition: %s", strerror(err));
+        tq_mutex_free(&pipeline->mutex);
+        tq_free(pipeline->tokens);
+        tq_free(pipeline);
+        return NULL;
+    }
+
+    return pipeline;
+}
+
+void
+tq_pipeline_delete(struct tq_pipeline *pipeline) {
+    if (!pipeline)
+        return;
+
+    for (int i = 0; i < pipeline->nb_stages; i++)
+        tq_mutex_free(&pipeline->stages[i].mutex);
+    tq_free(pipeline->stages);
+
+    tq_free(pipeline->tokens);
+
+    pthread_cond_destroy(&pipeline->cond);
+    tq_mutex_free(&pipeline->mutex);
+
+    tq_free(pipeline);
+}
+
+int
+tq_pipeline_add_stage(struct tq_pipeline *pipeline, enum tq_stage_mode mode,
+                      tq_stage_func func, void *arg) {
+    struct tq_pipeline_stage *stages, *stage;
+
+    stages = tq_realloc(pipeline->stages, (size_t)(pipeline->nb_stages + 1)
+                                        * sizeof(struct tq_pipeline_stage));
+    if (!stages) {
+        tq_set_error("cannot allocate pipeline stage: %m");
+        return -1;
+    }
+
+    pipeline->stages = stages;
+
+    stage = stages + pipeline->nb_stages;
+    memset(stage, 0, sizeof(struct tq_pipeline_stage));
+
+    /* The input stage is always serial and in order */
+    stage->mode = (pipeline->nb_stages == 0) ? TQ_STAGE_SERIAL_IN_ORDER : mode;
+    stage->func = func;
+    stage->arg = arg;
+
+    if (tq_mutex_init(&stage->mutex) == -1)
+        return -1;
+
+    pipeline->nb_stages++;
+    return 0;
+}
+
+int
+tq_pipeline_run(struct tq_pipeline *pipeline) {
+    struct tq_pipeline_token *token;
+
+    if (pipeline->nb_stages == 0) {
+        tq_set_error("empty pipeline");
+        return -1;
+    }
+
+    /* Reset the state of the pipeline */
+    pipeline->free_tokens = NULL;
+    for (int i = pipeline->nb_tokens - 1; i >= 0; i--) {
+        token = pipeline->tokens + i;
+        memset(token, 0, sizeof(struct tq_pipeline_token));
+
+        token->pipeline = pipeline;
+        token->next = pipeline->free_tokens;
+        pipeline->free_tokens = token;
+    }
+
+    for (int i = 0; i < pipeline->nb_stages; i++) {
+        struct tq_pipeline_stage *stage;
+
+        stage = pipeline->stages + i;
+        stage->busy = false;
+        stage->next_seq = 0;
+        stage->waiting = NULL;
+    }
+
+    pipeline->next_seq = 0;
+    pipeline->input_done = false;
+    pipeline->input_stalled = false;
+
+    token = pipeline->free_tokens;
+    pipeline->free_tokens = token->next;
+    pipeline->nb_active_tokens = 1;
+
+    tq_pipeline_submit(token);
+
+    if (tq_mutex_lock(&pipeline->mutex) == -1)
+        return -1;
+
+    while (!pipeline->input_done || pipeline->nb_active_tokens > 0)
+        pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+
+    tq_mutex_unlock(&pipeline->mutex);
+    return 0;
+}
+
+static void
+tq_pipeline_submit(struct tq_pipeline_token *token) {
+    struct tq_pipeline *pipeline;
+
+    pipeline = token->pipeline;
+
+    if (tq_queue_add_job(pipeline->queue, tq_pipeline_token_func,
+                         token) == -1) {
+        /* Do not lose the token, run it in the current thread */
+        tq_trace("cannot add pipeline job: %s", tq_get_error());
+        tq_pipeline_token_func(token);
+    }
+}
+
+static int
+tq_pipeline_token_func(void *arg) {
+    struct tq_pipeline_token *token;
+
+    token = arg;
+
+    if (token->stage == 0) {
+        tq_pipeline_input(token);
+    } else {
+        tq_pipeline_process(token);
+    }
+
+    return 0;
+}
+
+static void
+tq_pipeline_input(struct tq_pipeline_token *token) {
+    struct tq_pipeline *pipeline;
+    struct tq_pipeline_stage *stage;
+    struct tq_pipeline_token *next_token;
+
+    pipeline = token->pipeline;
+    stage = pipeline->stages;
+
+    token->item = stage->func(NULL, stage->arg);
+
+    tq_mutex_lock(&pipeline->mutex);
+
+    if (!token->item) {
+        pipeline->input_done = true;
+        tq_mutex_unlock(&pipeline->mutex);
+
+        tq_pipeline_release(token);
+        return;
+    }
+
+    token->seq = pipeline->next_seq++;
+
+    /* Start reading the next item if a token is available */
+    next_token = pipeline->free_tokens;
+    if (next_token) {
+        pipeline->free_tokens = next_token->next;
+        pipeline->nb_active_tokens++;
+    } else {
+        pipeline->input_stalled = true;
+    }
+
+    tq_mutex_unlock(&pipeline->mutex);
+
+    if (next_token)
+        tq_pipeline_submit(next_token);
+
+    token->stage = 1;
+    tq_pipeline_process(token);
+}
+
+static void
+tq_pipeline_process(struct tq_pipeline_token *token) {
+    struct tq_pipeline *pipeline;
+
+    pipeline = token->pipeline;
+
+    for (; token->stage < pipeline->nb_stages; token->stage++) {
+        struct tq_pipeline_stage *stage;
+        struct tq_pipeline_token *next_token;
+        bool in_order;
+
+        stage = pipeline->stages + token->stage;
+
+        if (stage->mode == TQ_STAGE_PARALLEL) {
+            if (token->item)
+                token->item = stage->func(token->item, stage->arg);
+            continue;
+        }
+
+        in_order = (stage->mode == TQ_STAGE_SERIAL_IN_ORDER);
+
+        if (token->owns_stage) {
+            /* The stage was handed over to us by the previous token */
+            token->owns_stage = false;
+        } else {
+            tq_mutex_lock(&stage->mutex);
+
+            if (stage->busy || (in_order && token->seq != stage->next_seq)) {
+                struct tq_pipeline_token **ptoken;
+
+                ptoken = &stage->waiting;
+                while (*ptoken && (!in_order || (*ptoken)->seq < token->seq))
+                    ptoken = &(*ptoken)->next;
+
+                token->next = *ptoken;
+                *ptoken = token;
+
+                tq_mutex_unlock(&stage->mutex);
+                return;
+            }
+
+            stage->busy = true;
+            tq_mutex_unlock(&stage->mutex);
+        }
+
+        /* Filtered items still go through in-order stages to keep their
+         * sequence numbers contiguous */
+        if (token->item)
+            token->item = stage->func(token->item, stage->arg);
+
+        tq_mutex_lock(&stage->mutex);
+
+        if (in_order)
+            stage->next_seq++;
+
+        next_token = stage->waiting;
+        if (next_token && (!in_order || next_token->seq == stage->next_seq)) {
+            stage->waiting = next_token->next;
+            next_token->owns_stage = true;
+        } else {
+            next_token = NULL;
+            stage->busy = false;
+        }
+
+        tq_mutex_unlock(&stage->mutex);
+
+        if (next_token)
+            tq_pipeline_submit(next_token);
+    }
+
+    tq_pipeline_release(token);
+}
+
+static void
+tq_pipeline_release(struct tq_pipeline_token *token) {
+    struct tq_pipeline *pipeline;
+    struct tq_pipeline_token *next_token;
+
+    pipeline = token->pipeline;
+
+    tq_mutex_lock(&pipeline->mutex);
+
+    token->item = NULL;
+    token->stage = 0;
+    token->next = NULL;
+
+    next_token = NULL;
+
+    if (pipeline->input_stalled && !pipeline->input_done) {
+        /* Reuse the token to read the next item */
+        pipeline->input_stalled = false;
+        next_token = token;
+    } else {
+        token->next = pipeline->free_tokens;
+        pipeline->free_tokens = token;
+        pipeline->nb_active_tokens--;
+
+        if (pipeline->input_done && pipeline->nb_active_tokens == 0)
+            pthread_cond_broadcast(&pipeline->cond);
+    }
+
+    tq_mutex_unlock(&pipeline->mutex);
+
+    if (next_token)
+        tq_pipeline_submit(next_token);
+}
@@ -0,0 +1,700 @@
+/*
+ * Copyright (c) 2013 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef TQ_PLATFORM_LINUX
+#   include <linux/futex.h>
+#   include <sys/syscall.h>
+#endif
+
+#include "taskqueue.h"
+#include "utils.h"
+
+#define TQ_SHM_MAGIC   0x74717368U /* "tqsh" */
+#define TQ_SHM_VERSION 2U
+
+#define TQ_SHM_MAX_CONSUMERS 64U
+
+/* Interval at which draining processes check for dead consumers */
+#define TQ_SHM_DRAIN_CHECK_INTERVAL_MS 100
+
+#define TQ_CACHE_LINE_SIZE 64U
+
+/* Consumers register themselves in the shared header so that a draining
+ * process knows which jobs are still running. A consumer is busy from
+ * before it claims a job until the handler returns; busy entries of dead
+ * processes are ignored. */
+struct tq_shm_consumer {
+    int32_t pid; /* 0 if the entry is free */
+    uint32_t busy;
+};
+
+/* Everything below lives in the shared mapping and is accessed by all
+ * processes; it must not contain pointers. Positions and sequence numbers
+ * follow the bounded MPMC queue design of Dmitry Vyukov: each slot carries
+ * a sequence number telling whether it is ready to be written or read for
+ * a given position. */
+struct tq_shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t nb_slots;
+    uint64_t slot_size;
+    uint64_t payload_size;
+
+    uint32_t stopped;
+
+    uint64_t enqueue_pos __attribute__((aligned(TQ_CACHE_LINE_SIZE)));
+    uint64_t dequeue_pos __attribute__((aligned(TQ_CACHE_LINE_SIZE)));
+
+    /* Futexes are event counters, incremented each time waiters may have
+     * to be woken up */
+    uint32_t not_empty __attribute__((aligned(TQ_CACHE_LINE_SIZE)));
+    uint32_t nb_consumers_waiting;
+    uint32_t not_full;
+    uint32_t nb_producers_waiting;
+
+    /* Incremented each time a consumer finishes a job while processes are
+     * draining the queue */
+    uint32_t idle __attribute__((aligned(TQ_CACHE_LINE_SIZE)));
+    uint32_t nb_drainers_waiting;
+
+    struct tq_shm_consumer consumers[TQ_SHM_MAX_CONSUMERS]
+        __attribute__((aligned(TQ_CACHE_LINE_SIZE)));
+} __attribute__((aligned(TQ_CACHE_LINE_SIZE)));
+
+struct tq_shm_slot {
+    uint64_t seq;
+    uint32_t handler;
+    uint32_t size;
+    char payload[];
+};
+
+struct tq_shm_queue {
+    struct tq_shm_header *header;
+    char *slots;
+    size_t mapsz;
+
+    char *name;
+    bool owner;
+
+    tq_handler_func *handlers;
+    uint32_t nb_handlers;
+};
+
+static struct tq_shm_queue *tq_shm_queue_init(const char *,
+                                              struct tq_shm_header *,
+                                              size_t, bool);
+
+static struct tq_shm_consumer *tq_shm_queue_add_consumer(
+    struct tq_shm_queue *);
+static void tq_shm_queue_set_idle(struct tq_shm_queue *,
+                                  struct tq_shm_consumer *);
+static bool tq_shm_queue_is_drained(struct tq_shm_queue *);
+static bool tq_shm_header_is_valid(const struct tq_shm_header *, size_t);
+static bool tq_process_is_dead(int32_t);
+
+static void tq_futex_wait(uint32_t *, uint32_t, const struct timespec *);
+static void tq_futex_wake(uint32_t *, int);
+
+static inline struct tq_shm_slot *
+tq_shm_queue_slot(struct tq_shm_queue *queue, uint64_t pos) {
+    uint64_t idx;
+
+    idx = pos & (queue->header->nb_slots - 1);
+    return (struct tq_shm_slot *)(queue->slots + idx * queue->header->slot_size);
+}
+
+struct tq_shm_queue *
+tq_shm_queue_new(const char *name, size_t nb_slots, size_t payload_size) {
+    struct tq_shm_queue *queue;
+    struct tq_shm_header *header;
+    size_t slot_size, mapsz, size;
+    int fd;
+
+    size = 1;
+    while (size < nb_slots)
+        size *= 2;
+
+    slot_size = sizeof(struct tq_shm_slot) + payload_size;
+    slot_size = (slot_size + TQ_CACHE_LINE_SIZE - 1)
+              & ~(size_t)(TQ_CACHE_LINE_SIZE - 1);
+
+    mapsz = sizeof(struct tq_shm_header) + size * slot_size;
+
+    if (name) {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd == -1) {
+            tq_set_error("cannot create shared memory object %s: %m", name);
+            return NULL;
+        }
+
+        if (ftruncate(fd, (off_t)mapsz) == -1) {
+            tq_set_error("cannot truncate shared memory object %s: %m", name);
+            close(fd);
+            shm_unlink(name);
+            return NULL;
+        }
+    } else {
+        fd = -1;
+    }
+
+    header = mmap(NULL, mapsz, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | (name ? 0 : MAP_ANONYMOUS), fd, 0);
+    if (header == MAP_FAILED) {
+        tq_set_error("cannot map shared memory: %m");
+        if (name) {
+            close(fd);
+            shm_unlink(name);
+        }
+        return NULL;
+    }
+
+    if (name)
+        close(fd);
+
+    memset(header, 0, sizeof(struct tq_shm_header));
+
+    header->version = TQ_SHM_VERSION;
+    header->nb_slots = size;
+    header->slot_size = slot_size;
+    header->payload_size = payload_size;
+
+    for (uint64_t i = 0; i < size; i++) {
+        struct tq_shm_slot *slot;
+
+        slot = (struct tq_shm_slot *)((char *)(header + 1) + i * slot_size);
+        slot->seq = i;
+    }
+
+    /* Processes opening the queue check the magic number last */
+    __atomic_store_n(&header->magic, TQ_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    queue = tq_shm_queue_init(name, header, mapsz, true);
+    if (!queue) {
+        munmap(header, mapsz);
+        if (name)
+            shm_unlink(name);
+        return NULL;
+    }
+
+    return queue;
+}
+
+struct tq_shm_queue *
+tq_shm_queue_open(const char *name) {
+    struct tq_shm_queue *queue;
+    struct tq_shm_header *header;
+    struct stat st;
+    size_t mapsz;
+    int fd;
+
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1) {
+        tq_set_error("cannot open shared memory object %s: %m", name);
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        tq_set_error("cannot stat shared memory object %s: %m", name);
+        close(fd);
+        return NULL;
+    }
+
+    mapsz = (size_t)st.st_size;
+    if (mapsz < sizeof(struct tq_shm_header)) {
+        tq_set_error("invalid shared memory object %s", name);
+        close(fd);
+        return NULL;
+    }
+
+    header = mmap(NULL, mapsz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        tq_set_error("cannot map shared memory object %s: %m", name);
+        close(fd);
+        return NULL;
+    }
+
+    close(fd);
+
+    if (!tq_shm_header_is_valid(header, mapsz)) {
+        tq_set_error("invalid shared memory object %s", name);
+        munmap(header, mapsz);
+        return NULL;
+    }
+
+    queue = tq_shm_queue_init(name, header, mapsz, false);
+    if (!queue) {
+        munmap(header, mapsz);
+        return NULL;
+    }
+
+    return queue;
+}
+
+void
+tq_shm_queue_delete(struct tq_shm_queue *queue) {
+    if (!queue)
+        return;
+
+    munmap(queue->header, queue->mapsz);
+
+    if (queue->owner && queue->name)
+        shm_unlink(queue->name);
+
+    tq_free(queue->name);
+    tq_free(queue->handlers);
+    tq_free(queue);
+}
+
+int
+tq_shm_queue_register_handler(struct tq_shm_queue *queue, uint32_t id,
+                              tq_handler_func func) {
+    return tq_handlers_register(&queue->handlers, &queue->nb_handlers,
+                                id, func);
+}
+
+int
+tq_shm_queue_add_job(struct tq_shm_queue *queue, uint32_t handler,
+                     const void *payload, size_t size) {
+    struct tq_shm_header *header;
+    struct tq_shm_slot *slot;
+    uint64_t pos;
+
+    header = queue->header;
+
+    if (size > header->payload_size) {
+        tq_set_error("payload too large (%zu bytes, maximum %zu)",
+                     size, (size_t)header->payload_size);
+        return -1;
+    }
+
+    for (;;) {
+        int64_t diff;
+        uint64_t seq;
+        uint32_t event;
+
+        pos = __atomic_load_n(&header->enqueue_pos, __ATOMIC_RELAXED);
+        slot = tq_shm_queue_slot(queue, pos);
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&header->enqueue_pos, &pos,
+                                            pos + 1, true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* The queue is full */
+            if (__atomic_load_n(&header->stopped, __ATOMIC_ACQUIRE)) {
+                tq_set_error("queue stopped");
+                return -1;
+            }
+
+            event = __atomic_load_n(&header->not_full, __ATOMIC_SEQ_CST);
+            __atomic_add_fetch(&header->nb_producers_waiting, 1,
+                               __ATOMIC_SEQ_CST);
+
+            seq = __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST);
+            if ((int64_t)(seq - pos) < 0)
+                tq_futex_wait(&header->not_full, event, NULL);
+
+            __atomic_sub_fetch(&header->nb_producers_waiting, 1,
+                               __ATOMIC_SEQ_CST);
+        }
+    }
+
+    slot->handler = handler;
+    slot->size = (uint32_t)size;
+    memcpy(slot->payload, payload, size);
+
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&header->nb_consumers_waiting, __ATOMIC_SEQ_CST) > 0) {
+        __atomic_add_fetch(&header->not_empty, 1, __ATOMIC_SEQ_CST);
+        tq_futex_wake(&header->not_empty, 1);
+    }
+
+    return 0;
+}
+
+int
+tq_shm_queue_run(struct tq_shm_queue *queue) {
+    struct tq_shm_header *header;
+    struct tq_shm_consumer *consumer;
+    char *payload;
+
+    header = queue->header;
+
+    /* Each call has its own copy of the payload of the current job, so that
+     * several threads can run the same queue */
+    payload = tq_malloc((size_t)header->payload_size + 1);
+    if (!payload) {
+        tq_set_error("cannot allocate payload buffer: %m");
+        return -1;
+    }
+
+    consumer = tq_shm_queue_add_consumer(queue);
+    if (!consumer) {
+        tq_free(payload);
+        return -1;
+    }
+
+    for (;;) {
+        struct tq_shm_slot *slot;
+        tq_handler_func func;
+        uint32_t handler, size;
+        uint64_t pos, seq;
+        int64_t diff;
+        uint32_t event;
+
+        if (__atomic_load_n(&header->stopped, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&consumer->pid, 0, __ATOMIC_SEQ_CST);
+            tq_free(payload);
+            return 0;
+        }
+
+        pos = __atomic_load_n(&header->dequeue_pos, __ATOMIC_RELAXED);
+        slot = tq_shm_queue_slot(queue, pos);
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        diff = (int64_t)(seq - (pos + 1));
+        if (diff < 0) {
+            /* The queue is empty */
+            event = __atomic_load_n(&header->not_empty, __ATOMIC_SEQ_CST);
+            __atomic_add_fetch(&header->nb_consumers_waiting, 1,
+                               __ATOMIC_SEQ_CST);
+
+            seq = __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST);
+            if ((int64_t)(seq - (pos + 1)) < 0
+             && !__atomic_load_n(&header->stopped, __ATOMIC_SEQ_CST)) {
+                tq_futex_wait(&header->not_empty, event, NULL);
+            }
+
+            __atomic_sub_fetch(&header->nb_consumers_waiting, 1,
+                               __ATOMIC_SEQ_CST);
+            continue;
+        } else if (diff > 0) {
+            continue;
+        }
+
+        /* Become busy before claiming the job, so that a draining process
+         * never sees the job neither queued nor running */
+        __atomic_store_n(&consumer->busy, 1, __ATOMIC_SEQ_CST);
+
+        if (!__atomic_compare_exchange_n(&header->dequeue_pos, &pos, pos + 1,
+                                         true, __ATOMIC_SEQ_CST,
+                                         __ATOMIC_RELAXED)) {
+            tq_shm_queue_set_idle(queue, consumer);
+            continue;
+        }
+
+        /* Copy the payload and release the slot before running the job, so
+         * that a process crashing in a handler does not block the queue */
+        handler = slot->handler;
+        size = slot->size;
+        if (size > header->payload_size)
+            size = 0;
+        memcpy(payload, slot->payload, size);
+
+        __atomic_store_n(&slot->seq, pos + header->nb_slots, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&header->nb_producers_waiting,
+                            __ATOMIC_SEQ_CST) > 0) {
+            __atomic_add_fetch(&header->not_full, 1, __ATOMIC_SEQ_CST);
+            tq_futex_wake(&header->not_full, 1);
+        }
+
+        func = tq_handlers_get(queue->handlers, queue->nb_handlers, handler);
+        if (func) {
+            func(payload, size);
+        } else {
+            tq_trace("no handler registered for id %u", handler);
+        }
+
+        tq_shm_queue_set_idle(queue, consumer);
+    }
+}
+
+int
+tq_shm_queue_stop(struct tq_shm_queue *queue) {
+    struct tq_shm_header *header;
+
+    header = queue->header;
+
+    __atomic_store_n(&header->stopped, 1, __ATOMIC_SEQ_CST);
+
+    __atomic_add_fetch(&header->not_empty, 1, __ATOMIC_SEQ_CST);
+    tq_futex_wake(&header->not_empty, INT32_MAX);
+
+    __atomic_add_fetch(&header->not_full, 1, __ATOMIC_SEQ_CST);
+    tq_futex_wake(&header->not_full, INT32_MAX);
+
+    return 0;
+}
+
+int
+tq_shm_queue_drain(struct tq_shm_queue *queue) {
+    struct tq_shm_header *header;
+
+    header = queue->header;
+
+    __atomic_add_fetch(&header->nb_drainers_waiting, 1, __ATOMIC_SEQ_CST);
+
+    for (;;) {
+        struct timespec timeout;
+        uint32_t event;
+
+        event = __atomic_load_n(&header->idle, __ATOMIC_SEQ_CST);
+        if (tq_shm_queue_is_drained(queue))
+            break;
+
+        /* Consumers dying while running a job never signal it */
+        timeout.tv_sec = 0;
+        timeout.tv_nsec = TQ_SHM_DRAIN_CHECK_INTERVAL_MS * 1000000L;
+
+        tq_futex_wait(&header->idle, event, &timeout);
+    }
+
+    __atomic_sub_fetch(&header->nb_drainers_waiting, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+static struct tq_shm_queue *
+tq_shm_queue_init(const char *name, struct tq_shm_header *header,
+                  size_t mapsz, bool owner) {
+    struct tq_shm_queue *queue;
+
+    queue = tq_malloc(sizeof(struct tq_shm_queue));
+    if (!queue) {
+        tq_set_error("cannot allocate shared queue: %m");
+        return NULL;
+    }
+
+    memset(queue, 0, sizeof(struct tq_shm_queue));
+
+    queue->header = header;
+    queue->slots = (char *)(header + 1);
+    queue->mapsz = mapsz;
+    queue->owner = owner;
+
+    if (name) {
+        size_t len;
+
+        len = strlen(name);
+
+        queue->name = tq_malloc(len + 1);
+        if (!queue->name) {
+            tq_set_error("cannot allocate shared queue name: %m");
+            goto error;
+        }
+
+        memcpy(queue->name, name, len + 1);
+    }
+
+    return queue;
+
+error:
+    tq_free(queue->name);
+    tq_free(queue);
+    return NULL;
+}
+
+/* Check a header created by another process before trusting its geometry */
+static bool
+tq_shm_header_is_valid(const struct tq_shm_header *header, size_t mapsz) {
+    uint64_t nb_slots, slot_size;
+
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != TQ_SHM_MAGIC
+     || header->version != TQ_SHM_VERSION) {
+        return false;
+    }
+
+    nb_slots = header->nb_slots;
+    slot_size = header->slot_size;
+
+    if (nb_slots == 0 || (nb_slots & (nb_slots - 1)) != 0)
+        return false;
+
+    if (slot_size < sizeof(struct tq_shm_slot)
+     || slot_size - sizeof(struct tq_shm_slot) < header->payload_size
+     || slot_size % TQ_CACHE_LINE_SIZE != 0) {
+        return false;
+    }
+
+    if (nb_slots > (mapsz - sizeof(struct tq_shm_header)) / slot_size)
+        return false;
+
+    return true;
+}
+
+static struct tq_shm_consumer *
+tq_shm_queue_add_consumer(struct tq_shm_queue *queue) {
+    struct tq_shm_header *header;
+    int32_t pid;
+
+    header = queue->header;
+    pid = (int32_t)getpid();
+
+    for (uint32_t i = 0; i < TQ_SHM_MAX_CONSUMERS; i++) {
+        struct tq_shm_consumer *consumer;
+        int32_t owner;
+
+        consumer = header->consumers + i;
+
+        /* Entries of dead processes are reused */
+        owner = __atomic_load_n(&consumer->pid, __ATOMIC_SEQ_CST);
+        if (owner != 0 && !tq_process_is_dead(owner))
+            continue;
+
+        if (__atomic_compare_exchange_n(&consumer->pid, &owner, pid, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            __atomic_store_n(&consumer->busy, 0, __ATOMIC_SEQ_CST);
+            return consumer;
+        }
+    }
+
+    tq_set_error("too many consumers (maximum %u)", TQ_SHM_MAX_CONSUMERS);
+    return NULL;
+}
+
+static void
+tq_shm_queue_set_idle(struct tq_shm_queue *queue,
+                      struct tq_shm_consumer *consumer) {
+    struct tq_shm_header *header;
+
+    header = queue->header;
+
+    __atomic_store_n(&consumer->busy, 0, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&header->nb_drainers_waiting, __ATOMIC_SEQ_CST) > 0) {
+        __atomic_add_fetch(&header->idle, 1, __ATOMIC_SEQ_CST);
+        tq_futex_wake(&header->idle, INT32_MAX);
+    }
+}
+
+/* The queue is drained when all jobs have been claimed and no consumer
+ * still alive is running one */
+static bool
+tq_shm_queue_is_drained(struct tq_shm_queue *queue) {
+    struct tq_shm_header *header;
+
+    header = queue->header;
+
+    if (__atomic_load_n(&header->enqueue_pos, __ATOMIC_SEQ_CST)
+     != __atomic_load_n(&header->dequeue_pos, __ATOMIC_SEQ_CST)) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < TQ_SHM_MAX_CONSUMERS; i++) {
+        struct tq_shm_consumer *consumer;
+        int32_t pid;
+
+        consumer = header->consumers + i;
+
+        pid = __atomic_load_n(&consumer->pid, __ATOMIC_SEQ_CST);
+        if (pid == 0 || !__atomic_load_n(&consumer->busy, __ATOMIC_SEQ_CST))
+            continue;
+
+        if (tq_process_is_dead(pid)) {
+            /* The job it was running is lost */
+            __atomic_compare_exchange_n(&consumer->pid, &pid, 0, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+tq_process_is_dead(int32_t pid) {
+    if (kill((pid_t)pid, 0) == -1 && errno == ESRCH)
+        return true;
+
+#ifdef TQ_PLATFORM_LINUX
+    {
+        char path[64], buf[256];
+        char *ptr;
+        ssize_t ret;
+        int fd;
+
+        /* A process which was not reaped yet by its parent is a zombie, and
+         * can still be signaled */
+        snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+
+        fd = open(path, O_RDONLY);
+        if (fd == -1)
+            return errno == ENOENT;
+
+        ret = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (ret <= 0)
+            return false;
+        buf[ret] = '\0';
+
+        /* The state follows the command name, which may contain spaces */
+        ptr = strrchr(buf, ')');
+        if (ptr && ptr[1] == ' ' && (ptr[2] == 'Z' || ptr[2] == 'X'))
+            return true;
+    }
+#endif
+
+    return false;
+}
+
+#ifdef TQ_PLATFORM_LINUX
+static void
+tq_futex_wait(uint32_t *addr, uint32_t value,
+              const struct timespec *timeout) {
+    /* The futex is shared between processes, so FUTEX_PRIVATE_FLAG must not
+     * be used. EAGAIN, EINTR and ETIMEDOUT only mean that the caller must
+     * check its condition again. */
+    syscall(SYS_futex, addr, FUTEX_WAIT, value, timeout, NULL, 0);
+}
+
+static void
+tq_futex_wake(uint32_t *addr, int nb_waiters) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, nb_waiters, NULL, NULL, 0);
+}
+#else
+static void
+tq_futex_wait(uint32_t *addr, uint32_t value,
+              const struct timespec *timeout) {
+    if (__atomic_load_n(addr, __ATOMIC_SEQ_CST) == value)
+        sched_yield();
+}
+
+static void
+tq_futex_wake(uint32_t *addr, int nb_waiters) {
+}
+#endif
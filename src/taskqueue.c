@@ -14,16 +14,36 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <errno.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 
 #include "taskqueue.h"
 #include "utils.h"
+#include "trace.h"
+#include "arena.h"
+#include "journal.h"
+#include "admission.h"
+
+#define TQ_DEFAULT_SCRATCH_SIZE (64U * 1024)
+#define TQ_DEFAULT_JOURNAL_SEGMENT_SIZE (64U * 1024 * 1024)
+
+#define TQ_CACHE_LINE_SIZE 64U
+
+/* Minimum time a worker waits before checking again parked jobs which
+ * could not be admitted when their token was due */
+#define TQ_UNPARK_MIN_DELAY_NS 1000000U
+
+#define TQ_KEY_NB_STRIPES 64U
+#define TQ_KEY_STRIPE_NB_BUCKETS 64U
 
 struct tq_worker {
     pthread_t thread;
@@ -31,6 +51,9 @@ struct tq_worker {
 
     struct tq_queue *queue;
 
+    struct tq_trace_ring *trace;
+    struct tq_arena scratch;
+
     bool exit;
 };
 
@@ -40,28 +63,210 @@ struct tq_job {
 
     struct tq_job *prev;
     struct tq_job *next;
+
+    uint64_t timestamp;
+
+    /* Called if the job is freed without having run */
+    tq_job_destroy_func destroy;
+
+    /* Keyed jobs are chained in a bucket of the key index while they are
+     * pending */
+    uint64_t key;
+    struct tq_job *key_next;
+    bool keyed;
+
+    /* Jobs added with tq_queue_admit_job() hold admission slots until they
+     * have run, in their job class and in the queue class which was set
+     * when they were admitted */
+    struct tq_job_class *job_class;
+    struct tq_job_class *queue_class;
+    bool admitted;
+
+    /* Optional data stored with the job, used as argument */
+    char data[] __attribute__((aligned(TQ_JOB_DATA_ALIGNMENT)));
 };
 
-struct tq_queue {
+/* Jobs are added at the head of the list and taken from the tail */
+struct tq_job_list {
     struct tq_job *jobs;
     struct tq_job *next_job;
+};
+
+struct tq_subqueue {
+    pthread_mutex_t mutex;
+    struct tq_job_list jobs;
+
+    /* Timestamp of the oldest job, UINT64_MAX if the subqueue is empty;
+     * read without locking to choose a subqueue */
+    uint64_t head_timestamp;
+} __attribute__((aligned(TQ_CACHE_LINE_SIZE)));
+
+/* The key index maps the keys of pending keyed jobs to their job. Buckets
+ * are grouped in stripes, each one protected by its own mutex. */
+struct tq_key_stripe {
+    pthread_mutex_t mutex;
+    struct tq_job *buckets[TQ_KEY_STRIPE_NB_BUCKETS];
+} __attribute__((aligned(TQ_CACHE_LINE_SIZE)));
+
+struct tq_job_class {
+    struct tq_admission admission;
+
+    enum tq_overload_action action;
+    tq_shed_func shed;
+
+    pthread_mutex_t mutex;
+    struct tq_job_list parked;
+    int nb_parked;
+};
+
+/* Jobs replayed from the journal are only queued once it has been opened
+ * successfully */
+struct tq_replay {
+    struct tq_queue *queue;
+    struct tq_job_list jobs;
+};
+
+struct tq_durable_job {
+    struct tq_queue *queue;
+    tq_handler_func func;
+
+    struct tq_journal_ref ref;
+
+    size_t size;
+    char payload[];
+};
+
+struct tq_queue {
+    enum tq_queue_mode mode;
+
+    struct tq_job_list jobs;
     int nb_jobs;
 
+    struct tq_subqueue *subqueues;
+    void *subqueues_mem;
+    int nb_subqueues;
+    int nb_idle_workers;
+
+    /* Allocated on the first keyed job */
+    void *key_index_mem;
+
+    struct tq_job_class *queue_class;
+    struct tq_job_class **classes;
+    uint32_t nb_classes;
+    int nb_parked;
+    int nb_admitted; /* queued, parked or running */
+
     struct tq_worker *workers;
     int nb_workers;
+    bool started;
 
     pthread_mutex_t mutex;
     pthread_cond_t cond;
+    pthread_cond_t drain_cond;
+
+    enum tq_idle_policy idle_policy;
+    unsigned int idle_nb_spins;
+    unsigned int idle_nb_yields;
 
     tq_job_started_hook job_started_hook;
     tq_job_done_hook job_done_hook;
+
+    struct tq_trace_ring *trace;
+
+    char *journal_dir;
+    size_t journal_segment_size;
+    struct tq_journal *journal;
+
+    tq_handler_func *handlers;
+    uint32_t nb_handlers;
 };
 
+static int tq_queue_push_job(struct tq_queue *, struct tq_job *);
+static struct tq_job *tq_queue_take_job(struct tq_queue *,
+                                        struct tq_worker *);
+
+static bool tq_worker_wait_for_job(struct tq_worker *);
+
+static void tq_job_list_push(struct tq_job_list *, struct tq_job *);
+static struct tq_job *tq_job_list_pop(struct tq_job_list *);
+static void tq_job_list_free(struct tq_job_list *);
+
+static void tq_queue_free_subqueues(struct tq_queue *);
+static int tq_queue_push_job_multi(struct tq_queue *, struct tq_job *);
+static struct tq_job *tq_queue_take_job_multi(struct tq_queue *,
+                                              struct tq_worker *);
+static struct tq_job *tq_queue_pop_job_multi(struct tq_queue *);
+
+static struct tq_key_stripe *tq_queue_key_stripes(struct tq_queue *);
+static void tq_queue_free_key_index(struct tq_queue *);
+static struct tq_job **tq_queue_key_bucket(struct tq_queue *, uint64_t,
+                                           struct tq_key_stripe **);
+static void tq_queue_unindex_job(struct tq_queue *, struct tq_job *);
+
+static struct tq_job_class *tq_job_class_new(
+    const struct tq_admission_policy *);
+static void tq_job_class_delete(struct tq_job_class *);
+static struct tq_job_class *tq_queue_acquire_job(struct tq_queue *,
+                                                 struct tq_job_class *);
+static void tq_queue_cancel_job(struct tq_queue *, struct tq_job_class *);
+static void tq_queue_release_job(struct tq_queue *, struct tq_job *);
+static int tq_queue_check_policy_change(struct tq_queue *);
+static void tq_queue_unpark_jobs(struct tq_queue *, struct tq_job_class *);
+static void tq_queue_unpark_all_jobs(struct tq_queue *);
+static bool tq_queue_get_unpark_time(struct tq_queue *, uint64_t *);
+
+static int tq_worker_park(struct tq_worker *);
+
+static int tq_queue_replay_job(struct tq_journal *, void *, uint32_t,
+                               const void *, size_t);
+static struct tq_job *tq_durable_job_new(struct tq_queue *, uint32_t,
+                                         const void *, size_t);
+static int tq_durable_job_func(void *);
+
 static void *tq_worker_func(void *);
 
+static __thread struct tq_worker *tq_current_worker;
+
+struct tq_job *
+tq_job_new(tq_job_func func, size_t data_size) {
+    struct tq_job *job;
+
+    job = tq_malloc(sizeof(struct tq_job) + data_size);
+    if (!job) {
+        tq_set_error("cannot allocate job: %m");
+        return NULL;
+    }
+
+    memset(job, 0, sizeof(struct tq_job));
+
+    job->func = func;
+    job->arg = (data_size > 0) ? job->data : NULL;
+
+    return job;
+}
+
+void
+tq_job_delete(struct tq_job *job) {
+    if (job->destroy)
+        job->destroy(job->arg);
+
+    tq_free(job);
+}
+
+void
+tq_job_set_destroy_func(struct tq_job *job, tq_job_destroy_func func) {
+    job->destroy = func;
+}
+
+void *
+tq_job_get_data(struct tq_job *job) {
+    return job->data;
+}
+
 struct tq_queue *
 tq_queue_new(int nb_workers) {
     struct tq_queue *queue;
+    pthread_condattr_t cond_attr;
     int err;
 
     queue = tq_malloc(sizeof(struct tq_queue));
@@ -86,6 +291,8 @@ tq_queue_new(int nb_workers) {
         worker = queue->workers + i;
         worker->id = i;
         worker->queue = queue;
+
+        tq_arena_init(&worker->scratch, TQ_DEFAULT_SCRATCH_SIZE, false);
     }
 
     if (tq_mutex_init(&queue->mutex) == -1) {
@@ -94,8 +301,22 @@ tq_queue_new(int nb_workers) {
         return NULL;
     }
 
-    err = pthread_cond_init(&queue->cond, NULL);
+    /* Workers wait with a timeout on the monotonic clock when jobs are
+     * parked by a rate limit */
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    err = pthread_cond_init(&queue->cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    if (err) {
+        tq_mutex_free(&queue->mutex);
+        tq_free(queue->workers);
+        tq_free(queue);
+        return NULL;
+    }
+
+    err = pthread_cond_init(&queue->drain_cond, NULL);
     if (err) {
+        pthread_cond_destroy(&queue->cond);
         tq_mutex_free(&queue->mutex);
         tq_free(queue->workers);
         tq_free(queue);
@@ -107,24 +328,33 @@ tq_queue_new(int nb_workers) {
 
 void
 tq_queue_delete(struct tq_queue *queue) {
-    struct tq_job *job;
-
     if (!queue)
         return;
 
-    job = queue->jobs;
-    while (job) {
-        struct tq_job *next;
+    tq_job_list_free(&queue->jobs);
+    tq_queue_free_subqueues(queue);
+    tq_queue_free_key_index(queue);
 
-        next = job->next;
-        tq_free(job);
-        job = next;
+    tq_job_class_delete(queue->queue_class);
+    for (uint32_t i = 0; i < queue->nb_classes; i++)
+        tq_job_class_delete(queue->classes[i]);
+    tq_free(queue->classes);
+
+    for (int i = 0; i < queue->nb_workers; i++) {
+        tq_trace_ring_delete(queue->workers[i].trace);
+        tq_arena_free(&queue->workers[i].scratch);
     }
+    tq_trace_ring_delete(queue->trace);
 
     tq_free(queue->workers);
 
+    tq_journal_close(queue->journal);
+    tq_free(queue->journal_dir);
+    tq_free(queue->handlers);
+
     tq_mutex_free(&queue->mutex);
     pthread_cond_destroy(&queue->cond);
+    pthread_cond_destroy(&queue->drain_cond);
 
     tq_free(queue);
 }
@@ -141,15 +371,294 @@ tq_queue_set_job_done_hook(struct tq_queue *queue,
     queue->job_done_hook = hook;
 }
 
+int
+tq_queue_set_scratch_size(struct tq_queue *queue, size_t size,
+                          bool hugepages) {
+    if (queue->started) {
+        tq_set_error("cannot change the scratch size of a started queue");
+        return -1;
+    }
+
+    for (int i = 0; i < queue->nb_workers; i++) {
+        struct tq_worker *worker;
+
+        worker = queue->workers + i;
+
+        tq_arena_free(&worker->scratch);
+        tq_arena_init(&worker->scratch, size, hugepages);
+    }
+
+    return 0;
+}
+
+int
+tq_queue_set_mode(struct tq_queue *queue, enum tq_queue_mode mode) {
+    struct tq_subqueue *subqueues;
+    int nb_subqueues;
+    void *mem;
+
+    if (queue->started) {
+        tq_set_error("cannot change the mode of a started queue");
+        return -1;
+    }
+
+    if (tq_queue_get_nb_jobs(queue) > 0) {
+        tq_set_error("cannot change the mode of a non-empty queue");
+        return -1;
+    }
+
+    tq_queue_free_subqueues(queue);
+    queue->mode = mode;
+
+    if (mode != TQ_QUEUE_MULTIQUEUE)
+        return 0;
+
+    nb_subqueues = queue->nb_workers * 2;
+    if (nb_subqueues < 2)
+        nb_subqueues = 2;
+
+    mem = tq_calloc((size_t)nb_subqueues + 1, sizeof(struct tq_subqueue));
+    if (!mem) {
+        tq_set_error("cannot allocate subqueues: %m");
+        queue->mode = TQ_QUEUE_FIFO;
+        return -1;
+    }
+
+    subqueues = (struct tq_subqueue *)(((uintptr_t)mem + TQ_CACHE_LINE_SIZE - 1)
+                                     & ~(uintptr_t)(TQ_CACHE_LINE_SIZE - 1));
+
+    for (int i = 0; i < nb_subqueues; i++) {
+        struct tq_subqueue *subqueue;
+
+        subqueue = subqueues + i;
+
+        if (tq_mutex_init(&subqueue->mutex) == -1) {
+            for (int j = 0; j < i; j++)
+                tq_mutex_free(&subqueues[j].mutex);
+
+            tq_free(mem);
+            queue->mode = TQ_QUEUE_FIFO;
+            return -1;
+        }
+
+        subqueue->head_timestamp = UINT64_MAX;
+    }
+
+    queue->subqueues = subqueues;
+    queue->subqueues_mem = mem;
+    queue->nb_subqueues = nb_subqueues;
+
+    return 0;
+}
+
+void
+tq_queue_set_idle_policy(struct tq_queue *queue, enum tq_idle_policy policy,
+                         unsigned int nb_spins, unsigned int nb_yields) {
+    queue->idle_policy = policy;
+    queue->idle_nb_spins = nb_spins;
+    queue->idle_nb_yields = nb_yields;
+}
+
 int
 tq_queue_get_nb_jobs(struct tq_queue *queue) {
-    return queue->nb_jobs;
+    return __atomic_load_n(&queue->nb_jobs, __ATOMIC_RELAXED);
+}
+
+int
+tq_queue_set_journal(struct tq_queue *queue, const char *dir,
+                     size_t segment_size) {
+    char *ndir;
+    size_t len;
+
+    len = strlen(dir);
+
+    ndir = tq_malloc(len + 1);
+    if (!ndir) {
+        tq_set_error("cannot allocate journal directory: %m");
+        return -1;
+    }
+
+    memcpy(ndir, dir, len + 1);
+
+    tq_free(queue->journal_dir);
+    queue->journal_dir = ndir;
+
+    if (segment_size == 0)
+        segment_size = TQ_DEFAULT_JOURNAL_SEGMENT_SIZE;
+    queue->journal_segment_size = segment_size;
+
+    return 0;
+}
+
+int
+tq_queue_register_handler(struct tq_queue *queue, uint32_t id,
+                          tq_handler_func func) {
+    return tq_handlers_register(&queue->handlers, &queue->nb_handlers,
+                                id, func);
+}
+
+int
+tq_queue_set_admission_policy(struct tq_queue *queue,
+                              const struct tq_admission_policy *policy) {
+    struct tq_job_class *job_class;
+
+    if (tq_queue_check_policy_change(queue) == -1)
+        return -1;
+
+    job_class = NULL;
+    if (policy) {
+        job_class = tq_job_class_new(policy);
+        if (!job_class)
+            return -1;
+    }
+
+    tq_job_class_delete(queue->queue_class);
+    queue->queue_class = job_class;
+
+    return 0;
+}
+
+int
+tq_queue_set_class_policy(struct tq_queue *queue, uint32_t class_id,
+                          const struct tq_admission_policy *policy) {
+    struct tq_job_class *job_class;
+
+    if (tq_queue_check_policy_change(queue) == -1)
+        return -1;
+
+    if (tq_table_grow(&queue->classes, &queue->nb_classes,
+                      sizeof(struct tq_job_class *), class_id) == -1) {
+        return -1;
+    }
+
+    job_class = NULL;
+    if (policy) {
+        job_class = tq_job_class_new(policy);
+        if (!job_class)
+            return -1;
+    }
+
+    tq_job_class_delete(queue->classes[class_id]);
+    queue->classes[class_id] = job_class;
+
+    return 0;
+}
+
+int
+tq_queue_enable_tracing(struct tq_queue *queue, size_t nb_events) {
+    if (queue->trace) {
+        tq_set_error("tracing already enabled");
+        return -1;
+    }
+
+    queue->trace = tq_trace_ring_new(nb_events, true);
+    if (!queue->trace)
+        return -1;
+
+    for (int i = 0; i < queue->nb_workers; i++) {
+        struct tq_worker *worker;
+
+        worker = queue->workers + i;
+
+        worker->trace = tq_trace_ring_new(nb_events, false);
+        if (!worker->trace) {
+            for (int j = 0; j < i; j++) {
+                tq_trace_ring_delete(queue->workers[j].trace);
+                queue->workers[j].trace = NULL;
+            }
+
+            tq_trace_ring_delete(queue->trace);
+            queue->trace = NULL;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int
+tq_queue_write_trace(struct tq_queue *queue, const char *path) {
+    FILE *file;
+    bool first;
+
+    if (!queue->trace) {
+        tq_set_error("tracing not enabled");
+        return -1;
+    }
+
+    file = fopen(path, "w");
+    if (!file) {
+        tq_set_error("cannot open %s: %m", path);
+        return -1;
+    }
+
+    first = true;
+
+    if (tq_trace_write_header(file) == -1)
+        goto error;
+
+    if (tq_trace_write_ring(file, queue->trace, 0, "producers", &first) == -1)
+        goto error;
+
+    for (int i = 0; i < queue->nb_workers; i++) {
+        struct tq_worker *worker;
+        char name[32];
+
+        worker = queue->workers + i;
+        snprintf(name, sizeof(name), "worker %d", worker->id);
+
+        if (tq_trace_write_ring(file, worker->trace, worker->id + 1, name,
+                                &first) == -1) {
+            goto error;
+        }
+    }
+
+    if (tq_trace_write_footer(file) == -1)
+        goto error;
+
+    if (fclose(file) == EOF) {
+        tq_set_error("cannot close %s: %m", path);
+        return -1;
+    }
+
+    return 0;
+
+error:
+    fclose(file);
+    return -1;
 }
 
 int
 tq_queue_start(struct tq_queue *queue) {
     int err;
 
+    if (queue->journal_dir && !queue->journal) {
+        struct tq_replay replay;
+        struct tq_job *job;
+
+        memset(&replay, 0, sizeof(struct tq_replay));
+        replay.queue = queue;
+
+        queue->journal = tq_journal_open(queue->journal_dir,
+                                         queue->journal_segment_size,
+                                         tq_queue_replay_job, &replay);
+        if (!queue->journal) {
+            tq_job_list_free(&replay.jobs);
+            return -1;
+        }
+
+        /* Pending jobs are queued before workers are started */
+        while ((job = tq_job_list_pop(&replay.jobs))) {
+            if (tq_queue_push_job(queue, job) == -1) {
+                /* Jobs not queued are not acknowledged and will be
+                 * replayed on the next start */
+                tq_free(job);
+                tq_job_list_free(&replay.jobs);
+                return -1;
+            }
+        }
+    }
+
     if (tq_mutex_lock(&queue->mutex) == -1)
         return -1;
 
@@ -185,6 +694,8 @@ tq_queue_start(struct tq_queue *queue) {
         }
     }
 
+    queue->started = true;
+
     tq_mutex_unlock(&queue->mutex);
     return 0;
 }
@@ -200,7 +711,7 @@ tq_queue_stop(struct tq_queue *queue) {
         struct tq_worker *worker;
 
         worker = queue->workers + i;
-        worker->exit = true;
+        __atomic_store_n(&worker->exit, true, __ATOMIC_RELEASE);
     }
 
     tq_mutex_unlock(&queue->mutex);
@@ -223,6 +734,8 @@ tq_queue_stop(struct tq_queue *queue) {
         }
     }
 
+    queue->started = false;
+
     return ret;
 }
 
@@ -230,64 +743,285 @@ int
 tq_queue_add_job(struct tq_queue *queue, tq_job_func func, void *arg) {
     struct tq_job *job;
 
-    job = tq_malloc(sizeof(struct tq_job));
-    if (!job) {
-        tq_set_error("cannot allocate job: %m");
+    job = tq_job_new(func, 0);
+    if (!job)
         return -1;
-    }
-
-    memset(job, 0, sizeof(struct tq_job));
 
-    job->func = func;
     job->arg = arg;
 
-    if (tq_mutex_lock(&queue->mutex) == -1) {
+    if (tq_queue_push_job(queue, job) == -1) {
         tq_free(job);
         return -1;
     }
 
-    if (queue->jobs) {
-        queue->jobs->prev = job;
-    } else {
-        queue->next_job = job;
-    }
-    job->next = queue->jobs;
-
-    queue->jobs = job;
-    queue->nb_jobs++;
-
-    if (queue->nb_jobs == 1) {
-        /* The queue is not empty anymore */
-        pthread_cond_broadcast(&queue->cond);
-    }
-
-    tq_mutex_unlock(&queue->mutex);
     return 0;
 }
 
 int
-tq_queue_drain(struct tq_queue *queue) {
-    int err;
+tq_queue_submit_job(struct tq_queue *queue, struct tq_job *job) {
+    return tq_queue_push_job(queue, job);
+}
 
-    for (;;) {
-        if (tq_mutex_lock(&queue->mutex) == -1)
-            return -1;
+int
+tq_queue_add_keyed_job(struct tq_queue *queue, uint64_t key,
+                       tq_job_func func, void *arg,
+                       tq_combine_func combine) {
+    struct tq_key_stripe *stripe;
+    struct tq_job **bucket;
+    struct tq_job *job;
 
-        /* Check before waiting in case there are currently no job in the
-         * queue */
-        if (queue->nb_jobs == 0)
-            break;
+    bucket = tq_queue_key_bucket(queue, key, &stripe);
+    if (!bucket)
+        return -1;
 
-        err = pthread_cond_wait(&queue->cond, &queue->mutex);
-        if (err) {
+    if (tq_mutex_lock(&stripe->mutex) == -1)
+        return -1;
+
+    for (job = *bucket; job; job = job->key_next) {
+        if (job->key == key && job->func == func) {
+            if (combine)
+                job->arg = combine(job->arg, arg);
+
+            tq_mutex_unlock(&stripe->mutex);
+            return 1;
+        }
+    }
+
+    job = tq_job_new(func, 0);
+    if (!job) {
+        tq_mutex_unlock(&stripe->mutex);
+        return -1;
+    }
+
+    job->arg = arg;
+    job->key = key;
+    job->keyed = true;
+
+    job->key_next = *bucket;
+    *bucket = job;
+
+    /* The job is queued with the stripe locked so that it cannot be
+     * combined with other jobs if it is not queued */
+    if (tq_queue_push_job(queue, job) == -1) {
+        *bucket = job->key_next;
+        tq_mutex_unlock(&stripe->mutex);
+
+        tq_free(job);
+        return -1;
+    }
+
+    tq_mutex_unlock(&stripe->mutex);
+    return 0;
+}
+
+int
+tq_queue_admit_job(struct tq_queue *queue, uint32_t class_id,
+                   tq_job_func func, void *arg) {
+    struct tq_job_class *job_class, *refused;
+    struct tq_job *job;
+
+    job_class = NULL;
+    if (class_id < queue->nb_classes)
+        job_class = queue->classes[class_id];
+
+    /* Give parked jobs a chance to go first */
+    if (job_class)
+        tq_queue_unpark_jobs(queue, job_class);
+    if (queue->queue_class)
+        tq_queue_unpark_jobs(queue, queue->queue_class);
+
+    refused = tq_queue_acquire_job(queue, job_class);
+
+    if (refused && refused->action == TQ_OVERLOAD_REJECT)
+        return TQ_JOB_REJECTED;
+
+    if (refused && refused->action == TQ_OVERLOAD_SHED) {
+        if (refused->shed)
+            refused->shed(arg);
+
+        return TQ_JOB_SHED;
+    }
+
+    job = tq_job_new(func, 0);
+    if (!job) {
+        if (!refused)
+            tq_queue_cancel_job(queue, job_class);
+        return -1;
+    }
+
+    job->arg = arg;
+    job->job_class = job_class;
+
+    if (refused) {
+        if (tq_mutex_lock(&refused->mutex) == -1) {
+            tq_free(job);
+            return -1;
+        }
+
+        __atomic_add_fetch(&queue->nb_admitted, 1, __ATOMIC_SEQ_CST);
+
+        tq_job_list_push(&refused->parked, job);
+        __atomic_add_fetch(&refused->nb_parked, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&queue->nb_parked, 1, __ATOMIC_SEQ_CST);
+
+        tq_mutex_unlock(&refused->mutex);
+
+        /* The jobs holding the slots may have completed before the job was
+         * parked */
+        tq_queue_unpark_jobs(queue, refused);
+
+        /* Wake up a worker so that it waits for the next token if no job
+         * completion is going to unpark the job */
+        if (refused->admission.interval > 0) {
+            if (tq_mutex_lock(&queue->mutex) == 0) {
+                pthread_cond_signal(&queue->cond);
+                tq_mutex_unlock(&queue->mutex);
+            }
+        }
+
+        return TQ_JOB_PARKED;
+    }
+
+    job->queue_class = queue->queue_class;
+    job->admitted = true;
+
+    __atomic_add_fetch(&queue->nb_admitted, 1, __ATOMIC_SEQ_CST);
+
+    if (tq_queue_push_job(queue, job) == -1) {
+        __atomic_sub_fetch(&queue->nb_admitted, 1, __ATOMIC_SEQ_CST);
+        tq_queue_cancel_job(queue, job_class);
+        tq_free(job);
+        return -1;
+    }
+
+    return TQ_JOB_QUEUED;
+}
+
+int
+tq_queue_add_durable_job(struct tq_queue *queue, uint32_t handler,
+                         const void *payload, size_t size) {
+    struct tq_durable_job *djob;
+    struct tq_job *job;
+
+    if (!queue->journal) {
+        tq_set_error("journal not available");
+        return -1;
+    }
+
+    job = tq_durable_job_new(queue, handler, payload, size);
+    if (!job)
+        return -1;
+
+    djob = job->arg;
+
+    if (tq_journal_append(queue->journal, handler, payload, size, true,
+                          &djob->ref) == -1) {
+        tq_free(job);
+        return -1;
+    }
+
+    if (tq_queue_push_job(queue, job) == -1) {
+        tq_free(job);
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+tq_queue_add_durable_jobs(struct tq_queue *queue,
+                          const struct tq_durable_job_spec *specs,
+                          size_t nb_specs) {
+    struct tq_job_list jobs;
+    struct tq_job *job;
+
+    if (!queue->journal) {
+        tq_set_error("journal not available");
+        return -1;
+    }
+
+    memset(&jobs, 0, sizeof(struct tq_job_list));
+
+    /* Records are appended without waiting for them to reach the disk, and
+     * synced all at once */
+    for (size_t i = 0; i < nb_specs; i++) {
+        const struct tq_durable_job_spec *spec;
+        struct tq_durable_job *djob;
+
+        spec = specs + i;
+
+        job = tq_durable_job_new(queue, spec->handler, spec->payload,
+                                 spec->size);
+        if (!job)
+            goto error;
+
+        djob = job->arg;
+
+        if (tq_journal_append(queue->journal, spec->handler, spec->payload,
+                              spec->size, false, &djob->ref) == -1) {
+            tq_free(job);
+            goto error;
+        }
+
+        tq_job_list_push(&jobs, job);
+    }
+
+    if (tq_journal_sync(queue->journal) == -1)
+        goto error;
+
+    while ((job = tq_job_list_pop(&jobs))) {
+        if (tq_queue_push_job(queue, job) == -1) {
+            /* The jobs which are not queued are on disk and will be
+             * replayed on the next start */
+            tq_free(job);
+            tq_job_list_free(&jobs);
+            return -1;
+        }
+    }
+
+    return 0;
+
+error:
+    /* Acknowledge the records already appended so that they are not
+     * replayed */
+    while ((job = tq_job_list_pop(&jobs))) {
+        struct tq_durable_job *djob;
+
+        djob = job->arg;
+        tq_journal_ack(queue->journal, &djob->ref);
+        tq_free(job);
+    }
+
+    return -1;
+}
+
+int
+tq_queue_drain(struct tq_queue *queue) {
+    int err;
+
+    for (;;) {
+        if (tq_mutex_lock(&queue->mutex) == -1)
+            return -1;
+
+        /* Check before waiting in case there are currently no job in the
+         * queue */
+        if (__atomic_load_n(&queue->nb_jobs, __ATOMIC_SEQ_CST) == 0
+         && __atomic_load_n(&queue->nb_parked, __ATOMIC_SEQ_CST) == 0) {
+            break;
+        }
+
+        err = pthread_cond_wait(&queue->drain_cond, &queue->mutex);
+        if (err) {
             tq_set_error("cannot wait for condition: %s", strerror(err));
             tq_mutex_unlock(&queue->mutex);
             return -1;
         }
 
         /* Check after waiting in case the last job was just removed */
-        if (queue->nb_jobs == 0)
+        if (__atomic_load_n(&queue->nb_jobs, __ATOMIC_SEQ_CST) == 0
+         && __atomic_load_n(&queue->nb_parked, __ATOMIC_SEQ_CST) == 0) {
             break;
+        }
 
         tq_mutex_unlock(&queue->mutex);
     }
@@ -296,78 +1030,853 @@ tq_queue_drain(struct tq_queue *queue) {
     return 0;
 }
 
-static void *
-tq_worker_func(void *arg) {
-    struct tq_worker *worker;
-    struct tq_queue *queue;
+static int
+tq_queue_push_job(struct tq_queue *queue, struct tq_job *job) {
+    tq_trace_ring_record(queue->trace, TQ_TRACE_ENQUEUE, job->arg);
 
-    worker = arg;
-    queue = worker->queue;
+    if (queue->mode == TQ_QUEUE_MULTIQUEUE)
+        return tq_queue_push_job_multi(queue, job);
+
+    if (tq_mutex_lock(&queue->mutex) == -1)
+        return -1;
+
+    tq_job_list_push(&queue->jobs, job);
+
+    if (__atomic_add_fetch(&queue->nb_jobs, 1, __ATOMIC_RELAXED) == 1) {
+        /* The queue is not empty anymore */
+        pthread_cond_broadcast(&queue->cond);
+    }
+
+    tq_mutex_unlock(&queue->mutex);
+    return 0;
+}
+
+static struct tq_job *
+tq_queue_take_job(struct tq_queue *queue, struct tq_worker *worker) {
+    struct tq_job *job;
+
+    if (queue->mode == TQ_QUEUE_MULTIQUEUE)
+        return tq_queue_take_job_multi(queue, worker);
 
-    /* Wait for the initialization to complete */
     if (tq_mutex_lock(&queue->mutex) == -1) {
         tq_trace("%s", tq_get_error());
         return NULL;
     }
 
+    do {
+        int ret;
+
+        if (worker->exit) {
+            tq_mutex_unlock(&queue->mutex);
+            return NULL;
+        }
+
+        job = tq_job_list_pop(&queue->jobs);
+        if (!job && queue->idle_policy != TQ_IDLE_SLEEP) {
+            bool found;
+
+            tq_mutex_unlock(&queue->mutex);
+            found = tq_worker_wait_for_job(worker);
+
+            if (tq_mutex_lock(&queue->mutex) == -1) {
+                tq_trace("%s", tq_get_error());
+                return NULL;
+            }
+
+            if (worker->exit) {
+                tq_mutex_unlock(&queue->mutex);
+                return NULL;
+            }
+
+            /* A job added while polling may have broadcast the condition
+             * before this worker was waiting on it: look again with the
+             * mutex held before parking */
+            job = tq_job_list_pop(&queue->jobs);
+
+            /* Another worker took the job, keep polling */
+            if (!job && found)
+                continue;
+        }
+
+        if (!job) {
+            ret = tq_worker_park(worker);
+            if (ret == -1) {
+                tq_mutex_unlock(&queue->mutex);
+                return NULL;
+            }
+
+            if (ret == 1) {
+                tq_mutex_unlock(&queue->mutex);
+                tq_queue_unpark_all_jobs(queue);
+
+                if (tq_mutex_lock(&queue->mutex) == -1) {
+                    tq_trace("%s", tq_get_error());
+                    return NULL;
+                }
+            }
+        }
+    } while (!job);
+
+    if (__atomic_sub_fetch(&queue->nb_jobs, 1, __ATOMIC_RELAXED) == 0)
+        pthread_cond_broadcast(&queue->drain_cond);
+
     tq_mutex_unlock(&queue->mutex);
+    return job;
+}
 
-    /* If initialization fails, the thread is going to be cancelled */
-    pthread_testcancel();
+static inline bool
+tq_worker_has_work(struct tq_worker *worker) {
+    return __atomic_load_n(&worker->queue->nb_jobs, __ATOMIC_RELAXED) > 0
+        || __atomic_load_n(&worker->exit, __ATOMIC_RELAXED);
+}
+
+/* Poll the queue before parking, according to the idle policy. Returns
+ * true if a job may be available or if the worker must exit, false if the
+ * worker should park. */
+static bool
+tq_worker_wait_for_job(struct tq_worker *worker) {
+    struct tq_queue *queue;
+    unsigned int i;
+
+    queue = worker->queue;
+
+    if (queue->idle_policy == TQ_IDLE_SPIN) {
+        /* Spinning workers never wait for parked jobs to be due */
+        while (!tq_worker_has_work(worker)) {
+            tq_queue_unpark_all_jobs(queue);
+            tq_cpu_relax();
+        }
+
+        return true;
+    }
+
+    for (i = 0; i < queue->idle_nb_spins; i++) {
+        if (tq_worker_has_work(worker))
+            return true;
+
+        tq_cpu_relax();
+    }
+
+    for (i = 0; i < queue->idle_nb_yields; i++) {
+        if (tq_worker_has_work(worker))
+            return true;
+
+        sched_yield();
+    }
 
+    return tq_worker_has_work(worker);
+}
+
+static void
+tq_job_list_push(struct tq_job_list *list, struct tq_job *job) {
+    if (list->jobs) {
+        list->jobs->prev = job;
+    } else {
+        list->next_job = job;
+    }
+    job->next = list->jobs;
+
+    list->jobs = job;
+}
+
+static struct tq_job *
+tq_job_list_pop(struct tq_job_list *list) {
+    struct tq_job *job;
+
+    job = list->next_job;
+    if (!job)
+        return NULL;
+
+    if (job->prev) {
+        job->prev->next = NULL;
+        list->next_job = job->prev;
+    } else {
+        list->jobs = NULL;
+        list->next_job = NULL;
+    }
+
+    job->prev = NULL;
+    return job;
+}
+
+static void
+tq_job_list_free(struct tq_job_list *list) {
+    struct tq_job *job;
+
+    job = list->jobs;
+    while (job) {
+        struct tq_job *next;
+
+        next = job->next;
+        tq_job_delete(job);
+        job = next;
+    }
+
+    list->jobs = NULL;
+    list->next_job = NULL;
+}
+
+static void
+tq_queue_free_subqueues(struct tq_queue *queue) {
+    for (int i = 0; i < queue->nb_subqueues; i++) {
+        struct tq_subqueue *subqueue;
+
+        subqueue = queue->subqueues + i;
+
+        tq_job_list_free(&subqueue->jobs);
+        tq_mutex_free(&subqueue->mutex);
+    }
+
+    tq_free(queue->subqueues_mem);
+
+    queue->subqueues = NULL;
+    queue->subqueues_mem = NULL;
+    queue->nb_subqueues = 0;
+}
+
+/* In multiqueue mode, jobs are spread over 2 * nb_workers subqueues, each
+ * one with its own lock. Producers insert jobs in a random subqueue;
+ * workers look at two random subqueues and take the oldest of their head
+ * jobs. Jobs are processed in an approximate FIFO order: the rank of the
+ * job taken among all queued jobs is O(nb_subqueues) in expectation.
+ *
+ * The queue mutex is only used to park idle workers. The job counter is
+ * incremented before a job is inserted, and idle workers register
+ * themselves before checking the counter, so that either the producer
+ * sees the idle worker and wakes it up, or the worker sees the job. */
+static int
+tq_queue_push_job_multi(struct tq_queue *queue, struct tq_job *job) {
+    struct tq_subqueue *subqueue;
+
+    __atomic_add_fetch(&queue->nb_jobs, 1, __ATOMIC_SEQ_CST);
+
+    subqueue = queue->subqueues + tq_random() % (uint32_t)queue->nb_subqueues;
+
+    if (tq_mutex_lock(&subqueue->mutex) == -1) {
+        __atomic_sub_fetch(&queue->nb_jobs, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+
+    job->timestamp = tq_clock();
+
+    if (!subqueue->jobs.jobs) {
+        __atomic_store_n(&subqueue->head_timestamp, job->timestamp,
+                         __ATOMIC_RELAXED);
+    }
+
+    tq_job_list_push(&subqueue->jobs, job);
+
+    tq_mutex_unlock(&subqueue->mutex);
+
+    if (__atomic_load_n(&queue->nb_idle_workers, __ATOMIC_SEQ_CST) > 0) {
+        if (tq_mutex_lock(&queue->mutex) == -1)
+            return -1;
+
+        pthread_cond_signal(&queue->cond);
+        tq_mutex_unlock(&queue->mutex);
+    }
+
+    return 0;
+}
+
+static struct tq_job *
+tq_queue_take_job_multi(struct tq_queue *queue, struct tq_worker *worker) {
     for (;;) {
         struct tq_job *job;
+        int ret;
 
-        /* Take the next job */
+        if (__atomic_load_n(&worker->exit, __ATOMIC_ACQUIRE))
+            return NULL;
+
+        job = tq_queue_pop_job_multi(queue);
+        if (job) {
+            if (__atomic_sub_fetch(&queue->nb_jobs, 1, __ATOMIC_SEQ_CST) == 0) {
+                if (tq_mutex_lock(&queue->mutex) == -1) {
+                    tq_trace("%s", tq_get_error());
+                } else {
+                    pthread_cond_broadcast(&queue->drain_cond);
+                    tq_mutex_unlock(&queue->mutex);
+                }
+            }
+
+            return job;
+        }
+
+        if (queue->idle_policy != TQ_IDLE_SLEEP) {
+            if (tq_worker_wait_for_job(worker))
+                continue;
+        }
+
+        /* Park until a job is added */
         if (tq_mutex_lock(&queue->mutex) == -1) {
             tq_trace("%s", tq_get_error());
             return NULL;
         }
 
-        do {
-            int err;
+        __atomic_add_fetch(&queue->nb_idle_workers, 1, __ATOMIC_SEQ_CST);
 
-            if (worker->exit) {
+        ret = 0;
+        while (__atomic_load_n(&queue->nb_jobs, __ATOMIC_SEQ_CST) == 0
+            && !worker->exit) {
+            ret = tq_worker_park(worker);
+            if (ret == -1) {
+                __atomic_sub_fetch(&queue->nb_idle_workers, 1,
+                                   __ATOMIC_SEQ_CST);
                 tq_mutex_unlock(&queue->mutex);
-                pthread_exit(NULL);
+                return NULL;
             }
 
-            job = queue->next_job;
-            if (!job) {
-                err = pthread_cond_wait(&queue->cond, &queue->mutex);
-                if (err) {
-                    tq_trace("cannot wait for condition: %s", strerror(err));
-                    tq_mutex_unlock(&queue->mutex);
-                    return NULL;
-                }
-            }
-        } while (!job);
-
-        if (job->prev) {
-            job->prev->next = NULL;
-            queue->next_job = job->prev;
-        } else {
-            queue->jobs = NULL;
-            queue->next_job = NULL;
+            if (ret == 1)
+                break;
         }
-        queue->nb_jobs--;
 
-        if (queue->nb_jobs == 0)
-            pthread_cond_broadcast(&queue->cond);
+        __atomic_sub_fetch(&queue->nb_idle_workers, 1, __ATOMIC_SEQ_CST);
 
         tq_mutex_unlock(&queue->mutex);
 
+        if (ret == 1)
+            tq_queue_unpark_all_jobs(queue);
+    }
+}
+
+static struct tq_job *
+tq_queue_pop_job_multi(struct tq_queue *queue) {
+    struct tq_subqueue *subqueue;
+    struct tq_job *job;
+    uint32_t nb_subqueues, i, j;
+    uint64_t ti, tj;
+
+    nb_subqueues = (uint32_t)queue->nb_subqueues;
+
+    /* Power of two choices */
+    i = tq_random() % nb_subqueues;
+    j = tq_random() % nb_subqueues;
+
+    ti = __atomic_load_n(&queue->subqueues[i].head_timestamp, __ATOMIC_RELAXED);
+    tj = __atomic_load_n(&queue->subqueues[j].head_timestamp, __ATOMIC_RELAXED);
+
+    if (tj < ti) {
+        i = j;
+        ti = tj;
+    }
+
+    if (ti == UINT64_MAX) {
+        /* Both subqueues are empty, look for any job */
+        for (j = 0; j < nb_subqueues; j++) {
+            uint32_t k;
+
+            k = (i + j) % nb_subqueues;
+            if (__atomic_load_n(&queue->subqueues[k].head_timestamp,
+                                __ATOMIC_RELAXED) != UINT64_MAX) {
+                break;
+            }
+        }
+
+        if (j == nb_subqueues)
+            return NULL;
+
+        i = (i + j) % nb_subqueues;
+    }
+
+    subqueue = queue->subqueues + i;
+
+    if (tq_mutex_lock(&subqueue->mutex) == -1) {
+        tq_trace("%s", tq_get_error());
+        return NULL;
+    }
+
+    job = tq_job_list_pop(&subqueue->jobs);
+
+    __atomic_store_n(&subqueue->head_timestamp,
+                     subqueue->jobs.next_job
+                         ? subqueue->jobs.next_job->timestamp
+                         : UINT64_MAX,
+                     __ATOMIC_RELAXED);
+
+    tq_mutex_unlock(&subqueue->mutex);
+    return job;
+}
+
+static struct tq_key_stripe *
+tq_queue_key_stripes(struct tq_queue *queue) {
+    void *mem;
+
+    mem = __atomic_load_n(&queue->key_index_mem, __ATOMIC_ACQUIRE);
+    if (!mem)
+        return NULL;
+
+    return (struct tq_key_stripe *)(((uintptr_t)mem + TQ_CACHE_LINE_SIZE - 1)
+                                  & ~(uintptr_t)(TQ_CACHE_LINE_SIZE - 1));
+}
+
+static void
+tq_queue_free_key_index(struct tq_queue *queue) {
+    struct tq_key_stripe *stripes;
+
+    stripes = tq_queue_key_stripes(queue);
+    if (!stripes)
+        return;
+
+    /* Pending keyed jobs are freed with the job lists */
+    for (uint32_t i = 0; i < TQ_KEY_NB_STRIPES; i++)
+        tq_mutex_free(&stripes[i].mutex);
+
+    tq_free(queue->key_index_mem);
+    queue->key_index_mem = NULL;
+}
+
+static struct tq_job **
+tq_queue_key_bucket(struct tq_queue *queue, uint64_t key,
+                    struct tq_key_stripe **pstripe) {
+    struct tq_key_stripe *stripes;
+    uint64_t hash;
+
+    stripes = tq_queue_key_stripes(queue);
+    if (!stripes) {
+        void *mem, *expected;
+
+        mem = tq_calloc(TQ_KEY_NB_STRIPES + 1, sizeof(struct tq_key_stripe));
+        if (!mem) {
+            tq_set_error("cannot allocate key index: %m");
+            return NULL;
+        }
+
+        stripes = (struct tq_key_stripe *)
+            (((uintptr_t)mem + TQ_CACHE_LINE_SIZE - 1)
+             & ~(uintptr_t)(TQ_CACHE_LINE_SIZE - 1));
+
+        for (uint32_t i = 0; i < TQ_KEY_NB_STRIPES; i++) {
+            if (tq_mutex_init(&stripes[i].mutex) == -1) {
+                for (uint32_t j = 0; j < i; j++)
+                    tq_mutex_free(&stripes[j].mutex);
+
+                tq_free(mem);
+                return NULL;
+            }
+        }
+
+        /* Another producer may have created the index concurrently */
+        expected = NULL;
+        if (!__atomic_compare_exchange_n(&queue->key_index_mem, &expected,
+                                         mem, false, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE)) {
+            for (uint32_t i = 0; i < TQ_KEY_NB_STRIPES; i++)
+                tq_mutex_free(&stripes[i].mutex);
+
+            tq_free(mem);
+            stripes = tq_queue_key_stripes(queue);
+        }
+    }
+
+    /* Fibonacci hashing: the high bits select the stripe and the bucket */
+    hash = key * UINT64_C(0x9e3779b97f4a7c15);
+
+    *pstripe = stripes + (hash >> 48) % TQ_KEY_NB_STRIPES;
+    return (*pstripe)->buckets + (hash >> 32) % TQ_KEY_STRIPE_NB_BUCKETS;
+}
+
+/* Keyed jobs are removed from the index as soon as they are taken and before
+ * their argument is read, so that a job submitted with the same key from
+ * this point is queued again instead of being combined with a job which
+ * may already be running. */
+static void
+tq_queue_unindex_job(struct tq_queue *queue, struct tq_job *job) {
+    struct tq_key_stripe *stripe;
+    struct tq_job **pjob;
+
+    pjob = tq_queue_key_bucket(queue, job->key, &stripe);
+
+    if (tq_mutex_lock(&stripe->mutex) == -1) {
+        tq_trace("%s", tq_get_error());
+        return;
+    }
+
+    while (*pjob != job)
+        pjob = &(*pjob)->key_next;
+    *pjob = job->key_next;
+
+    tq_mutex_unlock(&stripe->mutex);
+}
+
+static struct tq_job_class *
+tq_job_class_new(const struct tq_admission_policy *policy) {
+    struct tq_job_class *job_class;
+
+    job_class = tq_malloc(sizeof(struct tq_job_class));
+    if (!job_class) {
+        tq_set_error("cannot allocate job class: %m");
+        return NULL;
+    }
+
+    memset(job_class, 0, sizeof(struct tq_job_class));
+
+    tq_admission_init(&job_class->admission, policy->rate, policy->burst,
+                      policy->max_in_flight);
+
+    job_class->action = policy->action;
+    job_class->shed = policy->shed;
+
+    if (tq_mutex_init(&job_class->mutex) == -1) {
+        tq_free(job_class);
+        return NULL;
+    }
+
+    return job_class;
+}
+
+static void
+tq_job_class_delete(struct tq_job_class *job_class) {
+    if (!job_class)
+        return;
+
+    tq_job_list_free(&job_class->parked);
+    tq_mutex_free(&job_class->mutex);
+
+    tq_free(job_class);
+}
+
+/* Acquire the admission slots of the queue and of the job class. Returns
+ * NULL if the job is admitted, or the class whose limits refused it. */
+static struct tq_job_class *
+tq_queue_acquire_job(struct tq_queue *queue, struct tq_job_class *job_class) {
+    struct tq_job_class *queue_class;
+    uint64_t now;
+
+    queue_class = queue->queue_class;
+
+    if (!queue_class && !job_class)
+        return NULL;
+
+    now = tq_clock_ns();
+
+    if (queue_class && !tq_admission_acquire(&queue_class->admission, now))
+        return queue_class;
+
+    if (job_class && !tq_admission_acquire(&job_class->admission, now)) {
+        if (queue_class)
+            tq_admission_cancel(&queue_class->admission);
+        return job_class;
+    }
+
+    return NULL;
+}
+
+static void
+tq_queue_cancel_job(struct tq_queue *queue, struct tq_job_class *job_class) {
+    if (queue->queue_class)
+        tq_admission_cancel(&queue->queue_class->admission);
+    if (job_class)
+        tq_admission_cancel(&job_class->admission);
+}
+
+static void
+tq_queue_release_job(struct tq_queue *queue, struct tq_job *job) {
+    if (job->queue_class)
+        tq_admission_release(&job->queue_class->admission);
+
+    if (job->job_class) {
+        tq_admission_release(&job->job_class->admission);
+        tq_queue_unpark_jobs(queue, job->job_class);
+    }
+
+    if (job->queue_class)
+        tq_queue_unpark_jobs(queue, job->queue_class);
+
+    __atomic_sub_fetch(&queue->nb_admitted, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Job classes are referenced by admitted jobs and cannot be replaced while
+ * any of them is queued, parked or running */
+static int
+tq_queue_check_policy_change(struct tq_queue *queue) {
+    if (queue->started) {
+        tq_set_error("cannot change the admission policies of a started "
+                     "queue");
+        return -1;
+    }
+
+    if (__atomic_load_n(&queue->nb_admitted, __ATOMIC_SEQ_CST) > 0) {
+        tq_set_error("cannot change the admission policies of a queue with "
+                     "admitted jobs");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+tq_queue_unpark_jobs(struct tq_queue *queue, struct tq_job_class *job_class) {
+    struct tq_job *job;
+
+    if (__atomic_load_n(&job_class->nb_parked, __ATOMIC_SEQ_CST) == 0)
+        return;
+
+    /* Parked jobs are always subject to the limits of the class they are
+     * parked in */
+    if (!tq_admission_available(&job_class->admission, tq_clock_ns()))
+        return;
+
+    if (tq_mutex_lock(&job_class->mutex) == -1) {
+        tq_trace("%s", tq_get_error());
+        return;
+    }
+
+    while ((job = job_class->parked.next_job)) {
+        if (tq_queue_acquire_job(queue, job->job_class))
+            break;
+
+        tq_job_list_pop(&job_class->parked);
+
+        job->queue_class = queue->queue_class;
+        job->admitted = true;
+
+        if (tq_queue_push_job(queue, job) == -1) {
+            tq_trace("cannot queue parked job: %s", tq_get_error());
+            tq_queue_cancel_job(queue, job->job_class);
+            tq_job_delete(job);
+            __atomic_sub_fetch(&queue->nb_admitted, 1, __ATOMIC_SEQ_CST);
+        }
+
+        /* The job is accounted as queued before it stops being parked so
+         * that tq_queue_drain() never sees it as neither */
+        __atomic_sub_fetch(&job_class->nb_parked, 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_sub_fetch(&queue->nb_parked, 1, __ATOMIC_SEQ_CST) == 0) {
+            if (tq_mutex_lock(&queue->mutex) == -1) {
+                tq_trace("%s", tq_get_error());
+            } else {
+                pthread_cond_broadcast(&queue->drain_cond);
+                tq_mutex_unlock(&queue->mutex);
+            }
+        }
+    }
+
+    tq_mutex_unlock(&job_class->mutex);
+}
+
+static void
+tq_queue_unpark_all_jobs(struct tq_queue *queue) {
+    if (__atomic_load_n(&queue->nb_parked, __ATOMIC_SEQ_CST) == 0)
+        return;
+
+    for (uint32_t i = 0; i < queue->nb_classes; i++) {
+        if (queue->classes[i])
+            tq_queue_unpark_jobs(queue, queue->classes[i]);
+    }
+
+    if (queue->queue_class)
+        tq_queue_unpark_jobs(queue, queue->queue_class);
+}
+
+/* Find the earliest time at which a job parked by a rate limit may be
+ * admitted. Jobs waiting for an in-flight slot are unparked when a job
+ * completes and are ignored. */
+static bool
+tq_queue_get_unpark_time(struct tq_queue *queue, uint64_t *ptime) {
+    uint64_t time, min_time;
+
+    if (__atomic_load_n(&queue->nb_parked, __ATOMIC_SEQ_CST) == 0)
+        return false;
+
+    min_time = UINT64_MAX;
+
+    for (uint32_t i = 0; i <= queue->nb_classes; i++) {
+        struct tq_job_class *job_class;
+
+        job_class = (i < queue->nb_classes) ? queue->classes[i]
+                                            : queue->queue_class;
+        if (!job_class
+         || __atomic_load_n(&job_class->nb_parked, __ATOMIC_SEQ_CST) == 0) {
+            continue;
+        }
+
+        time = tq_admission_next_token(&job_class->admission);
+        if (time > 0 && time < min_time)
+            min_time = time;
+    }
+
+    if (min_time == UINT64_MAX)
+        return false;
+
+    /* The job may still be refused, e.g. by the limits of the queue; do not
+     * poll in a loop in that case */
+    time = tq_clock_ns() + TQ_UNPARK_MIN_DELAY_NS;
+    *ptime = (min_time > time) ? min_time : time;
+
+    return true;
+}
+
+/* Wait for a job with the queue mutex locked. Returns 1 if the wait timed
+ * out because parked jobs may now be admitted, in which case the caller
+ * unparks them once the mutex is unlocked, 0 when woken up, or -1 on
+ * error. */
+static int
+tq_worker_park(struct tq_worker *worker) {
+    struct tq_queue *queue;
+    uint64_t unpark_time;
+    int err;
+
+    queue = worker->queue;
+
+    tq_trace_ring_record(worker->trace, TQ_TRACE_PARK, NULL);
+
+    if (tq_queue_get_unpark_time(queue, &unpark_time)) {
+        struct timespec ts;
+
+        ts.tv_sec = (time_t)(unpark_time / 1000000000);
+        ts.tv_nsec = (long)(unpark_time % 1000000000);
+
+        err = pthread_cond_timedwait(&queue->cond, &queue->mutex, &ts);
+    } else {
+        err = pthread_cond_wait(&queue->cond, &queue->mutex);
+    }
+
+    tq_trace_ring_record(worker->trace, TQ_TRACE_UNPARK, NULL);
+
+    if (err == ETIMEDOUT)
+        return 1;
+
+    if (err) {
+        tq_trace("cannot wait for condition: %s", strerror(err));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+tq_queue_replay_job(struct tq_journal *journal, void *arg, uint32_t handler,
+                    const void *payload, size_t size) {
+    struct tq_durable_job *djob;
+    struct tq_replay *replay;
+    struct tq_job *job;
+
+    replay = arg;
+
+    job = tq_durable_job_new(replay->queue, handler, payload, size);
+    if (!job)
+        return -1;
+
+    djob = job->arg;
+
+    /* The journal is synced once all pending jobs have been replayed */
+    if (tq_journal_append(journal, handler, payload, size, false,
+                          &djob->ref) == -1) {
+        tq_free(job);
+        return -1;
+    }
+
+    tq_job_list_push(&replay->jobs, job);
+    return 0;
+}
+
+static struct tq_job *
+tq_durable_job_new(struct tq_queue *queue, uint32_t handler,
+                   const void *payload, size_t size) {
+    struct tq_durable_job *djob;
+    tq_handler_func func;
+    struct tq_job *job;
+
+    func = tq_handlers_get(queue->handlers, queue->nb_handlers, handler);
+    if (!func) {
+        tq_set_error("no handler registered for id %u", handler);
+        return NULL;
+    }
+
+    job = tq_job_new(tq_durable_job_func, sizeof(struct tq_durable_job) + size);
+    if (!job)
+        return NULL;
+
+    djob = job->arg;
+
+    djob->queue = queue;
+    djob->func = func;
+    djob->size = size;
+    memcpy(djob->payload, payload, size);
+
+    return job;
+}
+
+static int
+tq_durable_job_func(void *arg) {
+    struct tq_durable_job *djob;
+    int ret;
+
+    djob = arg;
+
+    ret = djob->func(djob->payload, djob->size);
+
+    if (tq_journal_ack(djob->queue->journal, &djob->ref) == -1)
+        tq_trace("cannot acknowledge job: %s", tq_get_error());
+
+    return ret;
+}
+
+static void *
+tq_worker_func(void *arg) {
+    struct tq_worker *worker;
+    struct tq_queue *queue;
+
+    worker = arg;
+    queue = worker->queue;
+
+    tq_current_worker = worker;
+
+    /* Wait for the initialization to complete */
+    if (tq_mutex_lock(&queue->mutex) == -1) {
+        tq_trace("%s", tq_get_error());
+        return NULL;
+    }
+
+    tq_mutex_unlock(&queue->mutex);
+
+    /* If initialization fails, the thread is going to be cancelled */
+    pthread_testcancel();
+
+    for (;;) {
+        struct tq_job *job;
+
+        /* Take the next job */
+        job = tq_queue_take_job(queue, worker);
+        if (!job)
+            break;
+
+        if (job->keyed)
+            tq_queue_unindex_job(queue, job);
+
+        tq_trace_ring_record(worker->trace, TQ_TRACE_DEQUEUE, job->arg);
+
         /* Process the job */
         if (queue->job_started_hook)
             queue->job_started_hook(job->arg);
 
+        tq_trace_ring_record(worker->trace, TQ_TRACE_START, job->arg);
         job->func(job->arg);
+        tq_trace_ring_record(worker->trace, TQ_TRACE_END, job->arg);
 
         if (queue->job_done_hook)
             queue->job_done_hook(job->arg);
 
+        if (job->admitted)
+            tq_queue_release_job(queue, job);
+
+        tq_arena_reset(&worker->scratch);
+
         tq_free(job);
     }
 
     return NULL;
 }
+
+void *
+tq_scratch_alloc(size_t sz) {
+    struct tq_worker *worker;
+
+    worker = tq_current_worker;
+    if (!worker) {
+        tq_set_error("scratch memory is only available in jobs");
+        return NULL;
+    }
+
+    return tq_arena_alloc(&worker->scratch, sz);
+}
@@ -18,6 +18,18 @@
 #define LIBTASKQUEUE_TASKQUEUE_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TQ_JOB_DATA_ALIGNMENT 16
+
+/* Handler and job class ids are indexes in tables and must be lower than
+ * TQ_MAX_ID. */
+#define TQ_MAX_ID 65536U
 
 struct tq_memory_allocator {
    void *(*malloc)(size_t sz);
@@ -28,17 +40,85 @@ struct tq_memory_allocator {
 
 extern struct tq_memory_allocator *tq_default_memory_allocator;
 
+enum tq_queue_mode {
+    TQ_QUEUE_FIFO,
+    TQ_QUEUE_MULTIQUEUE,
+};
+
+enum tq_idle_policy {
+    TQ_IDLE_SLEEP,
+    TQ_IDLE_HYBRID,
+    TQ_IDLE_SPIN,
+};
+
+enum tq_overload_action {
+    TQ_OVERLOAD_REJECT,
+    TQ_OVERLOAD_PARK,
+    TQ_OVERLOAD_SHED,
+};
+
+enum tq_admission_result {
+    TQ_JOB_QUEUED,
+    TQ_JOB_PARKED,
+    TQ_JOB_REJECTED,
+    TQ_JOB_SHED,
+};
+
+enum tq_stage_mode {
+    TQ_STAGE_SERIAL_IN_ORDER,
+    TQ_STAGE_SERIAL_OUT_OF_ORDER,
+    TQ_STAGE_PARALLEL,
+};
+
 typedef int (*tq_job_func)(void *);
+typedef void (*tq_job_destroy_func)(void *);
 
 typedef void (*tq_job_started_hook)(void *);
 typedef void (*tq_job_done_hook)(void *);
 
+typedef int (*tq_handler_func)(const void *payload, size_t size);
+
+typedef void *(*tq_combine_func)(void *pending_arg, void *arg);
+
+typedef void (*tq_shed_func)(void *arg);
+
+struct tq_admission_policy {
+    double rate; /* jobs per second, 0 for no rate limit */
+    uint32_t burst; /* jobs admitted at once when idle, at least 1 */
+    uint32_t max_in_flight; /* queued and running jobs, 0 for no limit */
+
+    enum tq_overload_action action;
+    tq_shed_func shed; /* optional, called with the argument of shed jobs */
+};
+
+struct tq_durable_job_spec {
+    uint32_t handler;
+    const void *payload;
+    size_t size;
+};
+
+typedef void *(*tq_stage_func)(void *item, void *arg);
+
 
 const char *tq_get_error(void);
 
 void tq_set_memory_allocator(const struct tq_memory_allocator *allocator);
 
 
+/* Jobs can be allocated with data_size bytes of storage aligned on
+ * TQ_JOB_DATA_ALIGNMENT bytes, passed as argument to the job function.
+ * The storage is released with the job once it has run, so that a job
+ * needs a single allocation. Once submitted, a job belongs to the queue;
+ * tq_job_delete() is only used on jobs which were not submitted. Jobs
+ * still queued or parked when the queue is deleted are freed without
+ * running; the optional destroy function is called with the argument of
+ * jobs freed without running, including by tq_job_delete(). */
+struct tq_job *tq_job_new(tq_job_func func, size_t data_size);
+void tq_job_delete(struct tq_job *job);
+void *tq_job_get_data(struct tq_job *job);
+void tq_job_set_destroy_func(struct tq_job *job, tq_job_destroy_func func);
+
+
 struct tq_queue *tq_queue_new(int nb_workers);
 void tq_queue_delete(struct tq_queue *queue);
 
@@ -46,11 +126,140 @@ void tq_queue_set_job_started_hook(struct tq_queue *queue,
                                    tq_job_started_hook hook);
 void tq_queue_set_job_done_hook(struct tq_queue *queue,
                                 tq_job_done_hook hook);
+/* Each worker owns a scratch arena, allocated in blocks of the given size
+ * from the memory allocator (or from hugepages when available and
+ * requested). It must be configured before the queue is started. */
+int tq_queue_set_scratch_size(struct tq_queue *queue, size_t size,
+                              bool hugepages);
+/* In multiqueue mode, jobs are spread over 2 * nb_workers independently
+ * locked subqueues, trading strict FIFO ordering for much lower contention
+ * with many producers. The mode must be set before the queue is started
+ * and before any job is added. */
+int tq_queue_set_mode(struct tq_queue *queue, enum tq_queue_mode mode);
+/* The idle policy controls what workers do when there is no job: sleep
+ * immediately (the default), spin nb_spins times with a pause instruction
+ * then yield the processor nb_yields times before sleeping (hybrid), or
+ * busy-poll without ever sleeping (spin, budgets are ignored). */
+void tq_queue_set_idle_policy(struct tq_queue *queue,
+                              enum tq_idle_policy policy,
+                              unsigned int nb_spins, unsigned int nb_yields);
 int tq_queue_get_nb_jobs(struct tq_queue *queue);
 
+/* Durable jobs are identified by a handler id and a payload, and are
+ * appended to a journal stored in dir before being queued. Jobs which were
+ * not processed when the process stopped are queued again when the queue is
+ * started. Jobs are processed at least once: a job may run again after a
+ * crash if its completion was not yet on disk. Handlers must be registered
+ * before the queue is started. A segment size of 0 selects the default. */
+int tq_queue_set_journal(struct tq_queue *queue, const char *dir,
+                         size_t segment_size);
+int tq_queue_register_handler(struct tq_queue *queue, uint32_t id,
+                              tq_handler_func func);
+
+/* Tracing records fixed-size events (enqueue, dequeue, job start and end,
+ * park and unpark) in per-worker ring buffers, keeping the last nb_events
+ * events of each thread. It must be enabled before the queue is started.
+ * The trace is written in the Chrome trace event format, readable by
+ * chrome://tracing and Perfetto; it should be written once the queue is
+ * stopped, since events recorded during the dump may be missing or torn. */
+int tq_queue_enable_tracing(struct tq_queue *queue, size_t nb_events);
+int tq_queue_write_trace(struct tq_queue *queue, const char *path);
+
 int tq_queue_start(struct tq_queue *queue);
 int tq_queue_stop(struct tq_queue *queue);
 int tq_queue_add_job(struct tq_queue *queue, tq_job_func func, void *arg);
+int tq_queue_submit_job(struct tq_queue *queue, struct tq_job *job);
+/* Keyed jobs are coalesced while they are pending: if a job with the same
+ * key and function is still queued, no new job is added and its argument
+ * is replaced by combine(pending_arg, arg), or left unchanged if combine is
+ * NULL. Returns 0 if the job was queued, 1 if it was coalesced, in which
+ * case the queue does not keep arg, or -1 on error. combine is called with
+ * a lock held and must not add jobs to the queue. A job submitted once the
+ * pending job has been taken by a worker is queued again. */
+int tq_queue_add_keyed_job(struct tq_queue *queue, uint64_t key,
+                           tq_job_func func, void *arg,
+                           tq_combine_func combine);
+/* Admission policies limit the rate and the number of queued and running
+ * jobs added with tq_queue_admit_job(), for the whole queue and for each job
+ * class. Limits are checked with atomic operations only. When a job is not
+ * admitted, the action of the policy which refused it is applied, and the
+ * result is returned immediately: the job is rejected and not queued, shed
+ * (the shed function of the policy is called with its argument), or parked.
+ * Parked jobs are queued in order once admitted, which is checked each time
+ * a job of the same class completes or is submitted, and by idle workers
+ * when the next token of a rate limit is due. tq_queue_drain() waits for
+ * parked jobs to be queued; they are freed without running when the queue
+ * is deleted. Policies must be set before the queue is started and before
+ * any job is admitted; a NULL policy removes the limits. tq_queue_add_job()
+ * is not subject to admission. */
+int tq_queue_set_admission_policy(struct tq_queue *queue,
+                                  const struct tq_admission_policy *policy);
+int tq_queue_set_class_policy(struct tq_queue *queue, uint32_t class_id,
+                              const struct tq_admission_policy *policy);
+int tq_queue_admit_job(struct tq_queue *queue, uint32_t class_id,
+                       tq_job_func func, void *arg);
 int tq_queue_drain(struct tq_queue *queue);
 
+/* Durable jobs are queued once their record is on disk. A single call
+ * waits for a sync of the journal, shared with concurrent callers; adding a
+ * batch of jobs appends all of them and syncs the journal once. If adding a
+ * batch fails, none of its jobs is queued. */
+int tq_queue_add_durable_job(struct tq_queue *queue, uint32_t handler,
+                             const void *payload, size_t size);
+int tq_queue_add_durable_jobs(struct tq_queue *queue,
+                              const struct tq_durable_job_spec *specs,
+                              size_t nb_specs);
+
+/* Allocate temporary memory from the scratch arena of the current worker.
+ * The memory is released after the job done hook returns, and must not be
+ * freed. Only usable from a job function or a job hook. */
+void *tq_scratch_alloc(size_t sz);
+
+/* Shared memory queues are used to dispatch jobs to several processes.
+ * Jobs are identified by a handler id, registered by each worker process,
+ * and carry a payload of at most payload_size bytes copied inline in the
+ * queue. A named queue is created with shm_open() and can be opened by
+ * unrelated processes; an anonymous queue (name is NULL) is shared with
+ * child processes created with fork(). Worker processes call
+ * tq_shm_queue_run() which processes jobs until the queue is stopped; there
+ * can be at most 64 of them at the same time, and several threads may run
+ * the same queue handle. A worker crashing in a handler
+ * loses the job it was running but does not block the queue:
+ * tq_shm_queue_drain() waits until all jobs have been taken and no live
+ * worker is running one, detecting dead workers within 100ms. */
+struct tq_shm_queue *tq_shm_queue_new(const char *name, size_t nb_slots,
+                                      size_t payload_size);
+struct tq_shm_queue *tq_shm_queue_open(const char *name);
+void tq_shm_queue_delete(struct tq_shm_queue *queue);
+
+int tq_shm_queue_register_handler(struct tq_shm_queue *queue, uint32_t id,
+                                  tq_handler_func func);
+
+int tq_shm_queue_add_job(struct tq_shm_queue *queue, uint32_t handler,
+                         const void *payload, size_t size);
+int tq_shm_queue_run(struct tq_shm_queue *queue);
+int tq_shm_queue_stop(struct tq_shm_queue *queue);
+int tq_shm_queue_drain(struct tq_shm_queue *queue);
+
+/* A pipeline streams items through a sequence of stages executed by the
+ * workers of a queue. The first stage is called with a NULL item and
+ * produces items until it returns NULL; it is always run serially. Each
+ * following stage receives the item returned by the previous one, and can
+ * drop it by returning NULL. Serial stages process one item at a time,
+ * either in input order or in any order; parallel stages process any
+ * number of items concurrently. At most max_tokens items are in flight.
+ * tq_pipeline_run() blocks until all items have gone through the pipeline
+ * and must not be called from a job. */
+struct tq_pipeline *tq_pipeline_new(struct tq_queue *queue, int max_tokens);
+void tq_pipeline_delete(struct tq_pipeline *pipeline);
+
+int tq_pipeline_add_stage(struct tq_pipeline *pipeline,
+                          enum tq_stage_mode mode,
+                          tq_stage_func func, void *arg);
+int tq_pipeline_run(struct tq_pipeline *pipeline);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2013 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBTASKQUEUE_TASKQUEUE_HPP
+#define LIBTASKQUEUE_TASKQUEUE_HPP
+
+/* C++ front end for libtaskqueue (C++11).
+ *
+ * Callables are moved directly into the storage of the job node, and run
+ * through a function specialized for their type: submitting a lambda costs
+ * a single allocation, like tq_queue_add_job(). Callables may be move-only;
+ * they are destroyed right after running, or when the queue is destroyed if
+ * they never ran, in which case futures returned by queue::async() report a
+ * broken promise. These futures use std::packaged_task, whose shared state
+ * needs one more allocation. */
+
+#include <condition_variable>
+#include <cstddef>
+#include <future>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "taskqueue.h"
+
+namespace tq {
+
+class error : public std::runtime_error {
+public:
+    error()
+        : std::runtime_error(tq_get_error()) {
+    }
+};
+
+class queue {
+public:
+    explicit queue(int nb_workers)
+        : queue_(tq_queue_new(nb_workers)), nb_workers_(nb_workers),
+          started_(false) {
+        if (!queue_)
+            throw error();
+    }
+
+    ~queue() {
+        if (started_)
+            tq_queue_stop(queue_);
+
+        tq_queue_delete(queue_);
+    }
+
+    queue(const queue &) = delete;
+    queue &operator=(const queue &) = delete;
+
+    struct tq_queue *native() {
+        return queue_;
+    }
+
+    int nb_workers() const {
+        return nb_workers_;
+    }
+
+    void start() {
+        if (tq_queue_start(queue_) == -1)
+            throw error();
+        started_ = true;
+    }
+
+    void stop() {
+        started_ = false;
+        if (tq_queue_stop(queue_) == -1)
+            throw error();
+    }
+
+    void drain() {
+        if (tq_queue_drain(queue_) == -1)
+            throw error();
+    }
+
+    /* Run f() in a worker. Exceptions escaping f() terminate the
+     * program. */
+    template <typename F>
+    void submit(F &&f) {
+        typedef typename std::decay<F>::type callable;
+
+        static_assert(alignof(callable) <= TQ_JOB_DATA_ALIGNMENT,
+                      "callable alignment not supported");
+
+        struct tq_job *job;
+
+        job = tq_job_new(&queue::run<callable>, sizeof(callable));
+        if (!job)
+            throw error();
+
+        try {
+            new (tq_job_get_data(job)) callable(std::forward<F>(f));
+        } catch (...) {
+            tq_job_delete(job);
+            throw;
+        }
+
+        tq_job_set_destroy_func(job, &queue::destroy<callable>);
+
+        if (tq_queue_submit_job(queue_, job) == -1) {
+            tq_job_delete(job);
+            throw error();
+        }
+    }
+
+    /* Run f() in a worker and return a future for its result */
+    template <typename F>
+    std::future<decltype(std::declval<F &>()())> async(F &&f) {
+        typedef decltype(std::declval<F &>()()) result;
+
+        std::packaged_task<result()> task(std::forward<F>(f));
+        std::future<result> future = task.get_future();
+
+        submit(std::move(task));
+        return future;
+    }
+
+    /* Call f(i) for each i in [begin, end), split in ranges of at least
+     * grain indexes, and wait for all calls to return. Must not be called
+     * from a job. */
+    template <typename Index, typename F>
+    void parallel_for(Index begin, Index end, const F &f, Index grain = 1) {
+        if (begin >= end)
+            return;
+
+        Index count = end - begin;
+        Index nb_ranges = static_cast<Index>(nb_workers_ * 4);
+        if (nb_ranges < 1)
+            nb_ranges = 1;
+
+        Index size = (count + nb_ranges - 1) / nb_ranges;
+        if (size < grain)
+            size = grain;
+
+        std::size_t nb_jobs = static_cast<std::size_t>((count + size - 1)
+                                                       / size);
+        std::size_t nb_submitted = 0;
+        latch done(nb_jobs);
+
+        try {
+            for (Index first = begin; first < end; first += size) {
+                Index last = (end - first > size) ? first + size : end;
+
+                submit([first, last, &f, &done]() {
+                    for (Index i = first; i < last; ++i)
+                        f(i);
+                    done.count_down(1);
+                });
+
+                nb_submitted++;
+            }
+        } catch (...) {
+            /* Ranges already submitted still reference f and done */
+            done.count_down(nb_jobs - nb_submitted);
+            done.wait();
+            throw;
+        }
+
+        done.wait();
+    }
+
+private:
+    template <typename F>
+    static int run(void *arg) noexcept {
+        F *f = static_cast<F *>(arg);
+
+        (*f)();
+        f->~F();
+
+        return 0;
+    }
+
+    template <typename F>
+    static void destroy(void *arg) noexcept {
+        static_cast<F *>(arg)->~F();
+    }
+
+    class latch {
+    public:
+        explicit latch(std::size_t count)
+            : count_(count) {
+        }
+
+        void count_down(std::size_t n) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            count_ -= n;
+            if (count_ == 0)
+                cond_.notify_all();
+        }
+
+        void wait() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (count_ > 0)
+                cond_.wait(lock);
+        }
+
+    private:
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        std::size_t count_;
+    };
+
+    struct tq_queue *queue_;
+    int nb_workers_;
+    bool started_;
+};
+
+}
+
+#endif
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2013 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "taskqueue.h"
+#include "utils.h"
+#include "trace.h"
+
+/* Reference points used to convert clock ticks to microseconds. The first
+ * one is taken when the first ring is created, the second one when a trace
+ * is written. */
+static uint64_t tq_trace_ticks0;
+static uint64_t tq_trace_ns0;
+
+static double tq_trace_ns_per_tick;
+static uint64_t tq_trace_ticks1;
+static uint64_t tq_trace_ns1;
+
+struct tq_trace_ring *
+tq_trace_ring_new(size_t nb_events, bool shared) {
+    struct tq_trace_ring *ring;
+    size_t size;
+
+    size = 1;
+    while (size < nb_events)
+        size *= 2;
+
+    ring = tq_malloc(sizeof(struct tq_trace_ring));
+    if (!ring) {
+        tq_set_error("cannot allocate trace ring: %m");
+        return NULL;
+    }
+
+    memset(ring, 0, sizeof(struct tq_trace_ring));
+
+    ring->events = tq_calloc(size, sizeof(struct tq_trace_event));
+    if (!ring->events) {
+        tq_set_error("cannot allocate trace events: %m");
+        tq_free(ring);
+        return NULL;
+    }
+
+    ring->mask = size - 1;
+    ring->shared = shared;
+
+    if (__atomic_load_n(&tq_trace_ticks0, __ATOMIC_RELAXED) == 0) {
+        tq_trace_ns0 = tq_clock_ns();
+        __atomic_store_n(&tq_trace_ticks0, tq_clock(), __ATOMIC_RELAXED);
+    }
+
+    return ring;
+}
+
+void
+tq_trace_ring_delete(struct tq_trace_ring *ring) {
+    if (!ring)
+        return;
+
+    tq_free(ring->events);
+    tq_free(ring);
+}
+
+static double
+tq_trace_ticks_to_us(uint64_t ticks) {
+    return (double)(ticks - tq_trace_ticks0) * tq_trace_ns_per_tick / 1000.0;
+}
+
+int
+tq_trace_write_header(FILE *file) {
+    tq_trace_ticks1 = tq_clock();
+    tq_trace_ns1 = tq_clock_ns();
+
+    if (tq_trace_ticks1 > tq_trace_ticks0) {
+        tq_trace_ns_per_tick = (double)(tq_trace_ns1 - tq_trace_ns0)
+                             / (double)(tq_trace_ticks1 - tq_trace_ticks0);
+    } else {
+        tq_trace_ns_per_tick = 1.0;
+    }
+
+    if (fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", file) == EOF) {
+        tq_set_error("cannot write trace: %m");
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+tq_trace_write_ring(FILE *file, const struct tq_trace_ring *ring,
+                    int tid, const char *name, bool *first) {
+    uint64_t head, start;
+    int ret;
+
+    ret = fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\","
+                  "\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                  *first ? "" : ",", tid, name);
+    if (ret < 0)
+        goto error;
+    *first = false;
+
+    if (!ring)
+        return 0;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    start = (head > ring->mask + 1) ? head - (ring->mask + 1) : 0;
+
+    for (uint64_t i = start; i < head; i++) {
+        const struct tq_trace_event *event;
+        const char *ename, *ph;
+
+        event = ring->events + (i & ring->mask);
+
+        switch (event->type) {
+            case TQ_TRACE_ENQUEUE: ename = "enqueue"; ph = "i"; break;
+            case TQ_TRACE_DEQUEUE: ename = "dequeue"; ph = "i"; break;
+            case TQ_TRACE_START:   ename = "job";     ph = "B"; break;
+            case TQ_TRACE_END:     ename = "job";     ph = "E"; break;
+            case TQ_TRACE_PARK:    ename = "idle";    ph = "B"; break;
+            case TQ_TRACE_UNPARK:  ename = "idle";    ph = "E"; break;
+            default:
+                continue;
+        }
+
+        ret = fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"%s\",%s"
+                      "\"ts\":%.3f,\"pid\":1,\"tid\":%d,"
+                      "\"args\":{\"arg\":\"0x%" PRIx64 "\"}}",
+                      ename, ph, (*ph == 'i') ? "\"s\":\"t\"," : "",
+                      tq_trace_ticks_to_us(event->ts), tid, event->arg);
+        if (ret < 0)
+            goto error;
+    }
+
+    return 0;
+
+error:
+    tq_set_error("cannot write trace: %m");
+    return -1;
+}
+
+int
+tq_trace_write_footer(FILE *file) {
+    if (fputs("\n]}\n", file) == EOF) {
+        tq_set_error("cannot write trace: %m");
+        return -1;
+    }
+
+    return 0;
+}
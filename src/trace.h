@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2013 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBTASKQUEUE_TRACE_H
+#define LIBTASKQUEUE_TRACE_H
+
+enum tq_trace_event_type {
+    TQ_TRACE_ENQUEUE,
+    TQ_TRACE_DEQUEUE,
+    TQ_TRACE_START,
+    TQ_TRACE_END,
+    TQ_TRACE_PARK,
+    TQ_TRACE_UNPARK,
+};
+
+struct tq_trace_event {
+    uint64_t ts;
+    uint64_t arg;
+    uint32_t type;
+    uint32_t pad;
+};
+
+/* A ring buffer of trace events. Worker rings only have one writer and are
+ * updated with plain stores; shared rings are used by any number of
+ * producers, which reserve their slot with an atomic increment. */
+struct tq_trace_ring {
+    struct tq_trace_event *events;
+    uint64_t mask;
+    uint64_t head;
+
+    bool shared;
+};
+
+struct tq_trace_ring *tq_trace_ring_new(size_t nb_events, bool shared);
+void tq_trace_ring_delete(struct tq_trace_ring *ring);
+
+static inline void
+tq_trace_ring_record(struct tq_trace_ring *ring,
+                     enum tq_trace_event_type type, const void *arg) {
+    struct tq_trace_event *event;
+    uint64_t idx;
+
+    if (!ring)
+        return;
+
+    if (ring->shared) {
+        idx = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    } else {
+        idx = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    }
+
+    event = ring->events + (idx & ring->mask);
+    event->ts = tq_clock();
+    event->arg = (uint64_t)(uintptr_t)arg;
+    event->type = type;
+
+    if (!ring->shared)
+        __atomic_store_n(&ring->head, idx + 1, __ATOMIC_RELEASE);
+}
+
+int tq_trace_write_header(FILE *file);
+int tq_trace_write_ring(FILE *file, const struct tq_trace_ring *ring,
+                        int tid, const char *name, bool *first);
+int tq_trace_write_footer(FILE *file);
+
+#endif
@@ -18,8 +18,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 
 #include <pthread.h>
+#include <time.h>
 
 #include "taskqueue.h"
 #include "utils.h"
@@ -120,6 +122,95 @@ void tq_trace(const char *fmt, ...) {
 #endif
 
 
+int
+tq_table_grow(void *ptable, uint32_t *pnb_entries, size_t entry_size,
+              uint32_t id) {
+    uint8_t *table;
+    uint32_t nb_entries;
+
+    if (id < *pnb_entries)
+        return 0;
+
+    if (id >= TQ_MAX_ID) {
+        tq_set_error("id %u is too large", id);
+        return -1;
+    }
+
+    nb_entries = id + 1;
+
+    table = tq_realloc(*(void **)ptable, nb_entries * entry_size);
+    if (!table) {
+        tq_set_error("cannot allocate table: %m");
+        return -1;
+    }
+
+    memset(table + *pnb_entries * entry_size, 0,
+           (nb_entries - *pnb_entries) * entry_size);
+
+    *(void **)ptable = table;
+    *pnb_entries = nb_entries;
+    return 0;
+}
+
+int
+tq_handlers_register(tq_handler_func **phandlers, uint32_t *pnb_handlers,
+                     uint32_t id, tq_handler_func func) {
+    if (tq_table_grow(phandlers, pnb_handlers, sizeof(tq_handler_func),
+                      id) == -1) {
+        return -1;
+    }
+
+    (*phandlers)[id] = func;
+    return 0;
+}
+
+tq_handler_func
+tq_handlers_get(tq_handler_func *handlers, uint32_t nb_handlers,
+                uint32_t id) {
+    if (id >= nb_handlers)
+        return NULL;
+
+    return handlers[id];
+}
+
+
+uint32_t
+tq_random(void) {
+    static __thread uint64_t state;
+    uint64_t x;
+
+    /* xorshift64*, seeded per thread */
+    x = state;
+    if (x == 0)
+        x = (tq_clock() ^ (uint64_t)(uintptr_t)&state) | 1;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    state = x;
+
+    return (uint32_t)((x * 2685821657736338717ULL) >> 32);
+}
+
+
+uint64_t
+tq_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return tq_clock_ns();
+#endif
+}
+
+uint64_t
+tq_clock_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+}
+
+
 int
 tq_mutex_init(pthread_mutex_t *mutex) {
     int err;
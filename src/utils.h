@@ -32,6 +32,26 @@ void tq_trace(const char *fmt, ...)
     __attribute__((format(printf, 1, 2)));
 #endif
 
+int tq_table_grow(void *ptable, uint32_t *pnb_entries, size_t entry_size,
+                  uint32_t id);
+
+int tq_handlers_register(tq_handler_func **phandlers, uint32_t *pnb_handlers,
+                         uint32_t id, tq_handler_func func);
+tq_handler_func tq_handlers_get(tq_handler_func *handlers,
+                                uint32_t nb_handlers, uint32_t id);
+
+uint32_t tq_random(void);
+
+static inline void
+tq_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+uint64_t tq_clock(void);
+uint64_t tq_clock_ns(void);
+
 int tq_mutex_init(pthread_mutex_t *mutex);
 int tq_mutex_free(pthread_mutex_t *mutex);
 int tq_mutex_lock(pthread_mutex_t *mutex);